@@ -1,14 +1,18 @@
 #include "devices/ide.h"
 #include <ctype.h>
 #include <debug.h>
+#include <packed.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include "devices/block.h"
 #include "devices/partition.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -30,10 +34,26 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, for a controller that can do
+   DMA.  Each channel has its own 8 ports in the controller's
+   block of 16. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus Master Command Register bits. */
+#define BMC_START 0x01          /* Start transfer. */
+#define BMC_READ 0x08           /* Transfer from disk to memory. */
+
+/* Bus Master Status Register bits. */
+#define BMS_ERROR 0x02          /* Transfer failed (write 1 to clear). */
+#define BMS_INTR 0x04           /* Disk interrupted (write 1 to clear). */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +69,34 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors one read or write command transfers.  The sector
+   count register holds 0 for this many. */
+#define MAX_TRANSFER 256
+
+/* A physical region descriptor, one entry in the table that tells
+   the bus master where in memory a DMA transfer goes.  A region
+   must not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address, even. */
+    uint16_t size;              /* Bytes, even, with 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the table's last entry. */
+  }
+PACKED;
+
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_BOUNDARY 0x10000    /* Regions may not cross multiples of this. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))  /* Entries in a table. */
+
+/* PCI configuration space access ports. */
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +105,9 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    size_t multiple;            /* Sectors per interrupt, 1 unless the
+                                   disk is in multiple mode. */
+    bool dma;                   /* Transfer by bus master DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -72,6 +123,9 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base port, 0 if no DMA. */
+    struct prd *prdt;           /* PRD table for DMA, one page. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -84,8 +138,13 @@ static struct block_operations ide_operations;
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, size_t);
+static uint16_t find_bus_master (void);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          const void **buffers, bool write);
+
+static void select_sectors (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -101,6 +160,7 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void)
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -126,6 +186,13 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->bm_base = bm_base + chan_no * 8;
+          c->prdt = palloc_get_page (PAL_ASSERT);
+        }
 
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +203,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 1;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -303,12 +372,102 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Let the disk transfer as many sectors per interrupt as it
+     can, if it supports READ MULTIPLE and WRITE MULTIPLE at all.
+     The low byte of word 47 gives that number. */
+  set_multiple_mode (d, (uint8_t) id[47 * 2]);
+
+  /* Use DMA if the controller is a bus master and the disk
+     supports DMA, as bit 8 of word 49 says. */
+  d->dma = c->bm_base != 0 && (id[49 * 2 + 1] & 0x01) != 0;
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
   partition_scan (block);
 }
 
+/* Puts disk D into multiple mode with CNT sectors per DRQ block,
+   so that READ MULTIPLE and WRITE MULTIPLE are used for its
+   transfers.  Leaves D's multiple mode off if CNT is less than 2
+   or D rejects CNT. */
+static void
+set_multiple_mode (struct ata_disk *d, size_t cnt)
+{
+  struct channel *c = d->channel;
+
+  d->multiple = 1;
+  if (cnt < 2)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_status (c)) & STA_ERR) == 0)
+    d->multiple = cnt;
+}
+
+/* Reads the 32-bit register at offset REG in the configuration
+   space of PCI function FUNC of device DEV on bus BUS. */
+static uint32_t
+pci_read_config (int bus, int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDRESS,
+        0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes DATA to the 32-bit register at offset REG in the
+   configuration space of PCI function FUNC of device DEV on bus
+   BUS. */
+static void
+pci_write_config (int bus, int dev, int func, int reg, uint32_t data)
+{
+  outl (PCI_CONFIG_ADDRESS,
+        0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | reg);
+  outl (PCI_CONFIG_DATA, data);
+}
+
+/* Looks on PCI bus 0 for an IDE controller that can act as a bus
+   master, such as the PIIX that QEMU emulates, and lets it master
+   the bus.  Returns the base of its bus master ports, or 0 if
+   there is no such controller. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar, command;
+
+        if ((pci_read_config (0, dev, func, 0x00) & 0xffff) == 0xffff)
+          continue;
+
+        /* Class 1, subclass 1 is an IDE controller, and bit 7 of
+           its programming interface says it can be a bus master.
+           Base address register 4 then holds its bus master
+           ports. */
+        class = pci_read_config (0, dev, func, 0x08);
+        if ((class >> 16) != 0x0101 || (class & 0x8000) == 0)
+          continue;
+        bar = pci_read_config (0, dev, func, 0x20);
+        if ((bar & 1) == 0 || (bar & 0xfffc) == 0)
+          continue;
+
+        /* Enable I/O space access and bus mastering.  The upper
+           half of the register is the status, whose bits are
+           cleared by writing 1, so it is written as 0. */
+        command = pci_read_config (0, dev, func, 0x04) & 0xffff;
+        pci_write_config (0, dev, func, 0x04, command | 0x05);
+        return bar & 0xfffc;
+      }
+  return 0;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +496,140 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Returns the number of sectors, starting at sector I of a
+   transfer that ends before sector END, that disk D moves between
+   two interrupts. */
+static size_t
+block_cnt (const struct ata_disk *d, size_t i, size_t end)
+{
+  return end - i < d->multiple ? end - i : d->multiple;
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFERS, each of which must have room for BLOCK_SECTOR_SIZE
+   bytes.  Each command reads up to MAX_TRANSFER sectors, by DMA
+   if possible.  Otherwise the disk interrupts as each block of
+   D->multiple sectors becomes ready.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_many (void *d_, block_sector_t sec_no, size_t cnt, void **buffers)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  size_t i = 0;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (i < cnt)
+    {
+      size_t end = cnt - i < MAX_TRANSFER ? cnt : i + MAX_TRANSFER;
+
+      if (dma_transfer (d, sec_no + i, end - i,
+                        (const void **) buffers + i, false))
+        {
+          i = end;
+          continue;
+        }
+      select_sectors (d, sec_no + i, end - i);
+      issue_pio_command (c, d->multiple > 1 ? CMD_READ_MULTIPLE
+                                            : CMD_READ_SECTOR_RETRY);
+      while (i < end)
+        {
+          size_t n = block_cnt (d, i, end);
+
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          for (; n > 0; n--, i++)
+            input_sector (c, buffers[i]);
+        }
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFERS, each of which must contain BLOCK_SECTOR_SIZE bytes.
+   Returns after the disk has acknowledged receiving the data.
+   Each command writes up to MAX_TRANSFER sectors, by DMA if
+   possible.  Otherwise the disk interrupts as it takes each block
+   of D->multiple sectors.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_many (void *d_, block_sector_t sec_no, size_t cnt,
+                const void **buffers)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  size_t i = 0;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (i < cnt)
+    {
+      size_t end = cnt - i < MAX_TRANSFER ? cnt : i + MAX_TRANSFER;
+
+      if (dma_transfer (d, sec_no + i, end - i, buffers + i, true))
+        {
+          i = end;
+          continue;
+        }
+      select_sectors (d, sec_no + i, end - i);
+      issue_pio_command (c, d->multiple > 1 ? CMD_WRITE_MULTIPLE
+                                            : CMD_WRITE_SECTOR_RETRY);
+      while (i < end)
+        {
+          size_t n = block_cnt (d, i, end);
+
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          for (; n > 0; n--, i++)
+            output_sector (c, buffers[i]);
+          sema_down (&c->completion_wait);
+        }
+    }
   lock_release (&c->lock);
 }
 
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void
+ide_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  ide_read_many (d_, sec_no, 1, &buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data. */
+static void
+ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_many (d_, sec_no, 1, &buffer);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_many,
+    ide_write_many
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT, at most MAX_TRANSFER, to the disk's
+   sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sectors (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_TRANSFER);
 
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_TRANSFER);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -414,6 +650,94 @@ issue_pio_command (struct channel *c, uint8_t command)
   outb (reg_command (c), command);
 }
 
+/* Fills in channel C's PRD table to cover the CNT buffers in
+   BUFFERS, each BLOCK_SECTOR_SIZE bytes, merging buffers that are
+   adjacent in physical memory into one region.  Returns false if
+   a buffer is at an odd address, which DMA cannot reach. */
+static bool
+build_prdt (struct channel *c, const void **buffers, size_t cnt)
+{
+  struct prd *prd = NULL;
+  size_t prd_size = 0;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    {
+      uintptr_t addr = vtop (buffers[i]);
+      size_t left = BLOCK_SECTOR_SIZE;
+
+      if (addr & 1)
+        return false;
+      while (left > 0)
+        {
+          size_t size = PRD_BOUNDARY - addr % PRD_BOUNDARY;
+          if (size > left)
+            size = left;
+
+          /* Extend the last region if this piece follows it and
+             lies within the same 64 kB. */
+          if (prd != NULL && prd->addr + prd_size == addr
+              && addr % PRD_BOUNDARY != 0)
+            prd_size += size;
+          else
+            {
+              prd = prd == NULL ? c->prdt : prd + 1;
+              ASSERT (prd < c->prdt + PRD_CNT);
+              prd->addr = addr;
+              prd->flags = 0;
+              prd_size = size;
+            }
+          prd->size = prd_size;
+          addr += size;
+          left -= size;
+        }
+    }
+  prd->flags = PRD_EOT;
+  return true;
+}
+
+/* Transfers the CNT sectors starting at SEC_NO between disk D and
+   BUFFERS by bus master DMA, writing them to the disk if WRITE and
+   reading them otherwise, with one interrupt at the end.  CNT must
+   be at most MAX_TRANSFER, and the caller must hold the channel's
+   lock.  Returns false, without touching the disk, if D cannot do
+   DMA or the buffers are unsuitable, so that the caller falls
+   back to PIO. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              const void **buffers, bool write)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = write ? 0 : BMC_READ;
+  uint8_t bm_status, status;
+
+  ASSERT (cnt > 0 && cnt <= MAX_TRANSFER);
+
+  if (!d->dma || !build_prdt (c, buffers, cnt))
+    return false;
+
+  /* Point the bus master at the PRD table and clear its status
+     from any earlier transfer. */
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BMS_ERROR | BMS_INTR);
+
+  /* Start the transfer and wait for the disk to finish it. */
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), direction | BMC_START);
+  sema_down (&c->completion_wait);
+  outb (reg_bm_command (c), direction);
+
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), bm_status | BMS_ERROR | BMS_INTR);
+  status = inb (reg_status (c));
+  if ((bm_status & BMS_ERROR) != 0 || (status & STA_ERR) != 0)
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu,
+           d->name, write ? "write" : "read", sec_no);
+  return true;
+}
+
 /* Reads a sector from channel C's data register in PIO mode into
    SECTOR, which must have room for BLOCK_SECTOR_SIZE bytes. */
 static void
@@ -317,8 +317,30 @@ partition_write (void *p_, block_sector_t sector, const void *buffer)
   block_write (p->block, p->start + sector, buffer);
 }
 
+/* Reads the CNT sectors starting at SECTOR from partition P into
+   BUFFERS, one sector each. */
+static void
+partition_read_many (void *p_, block_sector_t sector, size_t cnt,
+                     void **buffers)
+{
+  struct partition *p = p_;
+  block_read_many (p->block, p->start + sector, cnt, buffers);
+}
+
+/* Writes the CNT sectors starting at SECTOR to partition P from
+   BUFFERS, one sector each. */
+static void
+partition_write_many (void *p_, block_sector_t sector, size_t cnt,
+                      const void **buffers)
+{
+  struct partition *p = p_;
+  block_write_many (p->block, p->start + sector, cnt, buffers);
+}
+
 static struct block_operations partition_operations =
   {
     partition_read,
-    partition_write
+    partition_write,
+    partition_read_many,
+    partition_write_many
   };
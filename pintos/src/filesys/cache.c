@@ -1,204 +1,1243 @@
 #include "filesys/cache.h"
 #include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/thread.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/malloc.h"
+#include "threads/vaddr.h"
 #include "filesys/filesys.h"
 #include "devices/timer.h"
 #include "filesys/off_t.h"
 
-#define CACHE_SIZE 64
+#define CACHE_DEFAULT_SIZE 64
+#define CACHE_SHARDS 8                    /* Independently locked parts of the cache */
 #define INVALID_SECTOR ((block_sector_t) -1)
+#define FLUSH_INTERVAL (5 * TIMER_FREQ)   /* Ticks between periodic write-behind */
+#define FLUSH_POLL (TIMER_FREQ / 10)      /* Ticks between dirty ratio checks */
+#define DIRTY_HIGH_PCT 50                 /* Flush early past this % of dirty entries */
+#define READ_AHEAD_SLOTS 64               /* Read-ahead requests that may be queued */
+#define RUN_MAX 32                        /* Most sectors in one disk request */
+#define READ_AHEAD_RUN 4                  /* Most sectors read ahead in one request */
 
-static int hand;                          /* Clock hand */
-struct cache_entry *entries[CACHE_SIZE];  /* Cache Entries */
-static struct lock cache_lock;            /* A lock for using the cache */
+/* 2Q queues an entry can be on. */
+enum cache_queue{
+  QUEUE_NONE,                             /* Not on a queue, e.g. free */
+  QUEUE_A1IN,                             /* Accessed once since being mapped */
+  QUEUE_AM                                /* Accessed again while cached or remembered */
+};
 
 struct cache_entry{
   block_sector_t sector;                  /* The sector this entry maps to */
-  bool ref;                               /* Reference flag for the entry, initialized to true */
-  bool dirty;                             /* Dirty flag for the entry */
-  bool up_to_date;
-  int use_count;
+  bool ref;                               /* Set on every access, cleared by the clock hand */
+  bool dirty;                             /* Dirty flag, changed holding block_lock and shard lock */
+  bool up_to_date;                        /* Whether data holds the sector's contents */
+  int use_count;                          /* Threads holding or waiting for block_lock */
+  bool prefetched;                        /* Mapped by read-ahead, not accessed since */
+  bool held;                              /* Kept from disk until cache_unhold() */
+  block_sector_t owner;                   /* Inode of the file whose data this is */
+
+  struct cache_shard *shard;              /* The shard this entry belongs to */
+  struct hash_elem hash_elem;             /* Element in the shard's index */
+  struct list_elem elem;                  /* Element in free_entries or a 2Q queue */
+  enum cache_queue queue;                 /* 2Q queue holding the entry */
+  struct rwlock block_lock;               /* Shared by readers, held alone by writers */
+
+  uint8_t *data;                          /* This entry's block in cache_data */
+};
+
+/* 2Q: a sector recently evicted from a1in, one slot of a1out. */
+struct cache_ghost{
+  block_sector_t sector;                  /* Ghost's sector, or INVALID_SECTOR if the slot is free */
+  struct hash_elem hash_elem;             /* Element in the shard's ghosts, while in use */
+};
+
+/* A sector is only ever cached in shard SECTOR % shard_cnt, so
+   threads working on sectors of different shards never contend
+   for the same lock. */
+struct cache_shard{
+  struct lock lock;                       /* Protects the shard and its entries' metadata */
+  struct hash index;                      /* Maps sectors to cache entries */
+  struct list free_entries;               /* Entries not mapped to any sector */
+  struct condition entry_released;        /* Signaled when an entry becomes unused */
+  struct cache_entry *entries;            /* First of the shard's entries */
+  size_t size;                            /* Number of entries in the shard */
+  size_t hand;                            /* Clock hand, an index into entries */
+
+  struct list a1in;                       /* 2Q: first-time entries, newest in front */
+  struct list am;                         /* 2Q: reused entries, most recent in front */
+  size_t a1in_cnt;                        /* 2Q: number of entries on a1in */
+  size_t a1in_max;                        /* 2Q: a1in size beyond which it is evicted from first */
+  struct cache_ghost *a1out;              /* 2Q: ring of sectors recently evicted from a1in */
+  struct hash ghosts;                     /* 2Q: maps sectors to their a1out slots */
+  size_t a1out_size;                      /* 2Q: number of slots in a1out */
+  size_t a1out_next;                      /* 2Q: slot to overwrite next */
+
+  size_t dirty_cnt;                       /* Number of dirty entries */
+  struct cache_stats stats;               /* Counters, except for lock waits and flushes */
+};
+
+static size_t cache_size = CACHE_DEFAULT_SIZE;  /* Number of entries */
+static struct cache_entry *entries;       /* Cache Entries, cache_size of them */
+static uint8_t *cache_data;               /* Contiguous data blocks of all entries */
+static struct cache_shard shards[CACHE_SHARDS];
+static size_t shard_cnt;                  /* Number of shards in use */
+static unsigned long long lock_waits;     /* Contended lock acquisitions, changed with interrupts off */
+static unsigned long long lock_wait_ticks; /* Ticks spent in them, changed with interrupts off */
+static unsigned long long flushes;        /* cache_flush() passes, changed with interrupts off */
+static unsigned flushes_running;          /* Passes in progress, changed with interrupts off */
+
+static struct lock flush_lock;            /* Serializes cache_flush() */
+static struct cache_entry **flush_order;  /* Dirty entries sorted by cache_flush() */
+static bool flusher_exit;                 /* Tells the flusher thread to stop */
+static struct semaphore flusher_done;     /* Up'd by the flusher thread as it stops */
 
-  struct condition block_cond;            /* control access to the entry */
-  struct lock block_lock;
-  struct lock data_lock;
+/* A held entry's block, set aside when the entry was evicted. */
+struct spilled_block{
+  struct list_elem elem;                  /* Element in spilled */
+  block_sector_t sector;                  /* The sector it belongs to */
+  uint8_t data[BLOCK_SECTOR_SIZE];        /* Its contents */
+};
+
+static struct list spilled;               /* Blocks of evicted held entries */
+static struct lock spill_lock;            /* Protects spilled */
+
+static block_sector_t ra_queue[READ_AHEAD_SLOTS]; /* Ring of sectors to prefetch */
+static size_t ra_head;                    /* Index of the oldest queued sector */
+static size_t ra_cnt;                     /* Number of queued sectors */
+static struct lock ra_lock;               /* Protects the read-ahead queue */
+static struct condition ra_queued;        /* Signaled when a sector is queued */
+static bool read_ahead_exit;              /* Tells the read-ahead thread to stop */
+static struct semaphore read_ahead_done;  /* Up'd by the read-ahead thread as it stops */
 
-  uint8_t data[BLOCK_SECTOR_SIZE];        /* A block of data */
+/* A replacement policy.  Every function is called with the
+   shard's lock held. */
+struct cache_policy{
+  const char *name;                       /* Name for -cache-policy */
+  /* Picks an unpinned entry of SHARD to evict, or returns NULL */
+  struct cache_entry *(*evict) (struct cache_shard *shard);
+  /* ENTRY was just mapped to its sector */
+  void (*insert) (struct cache_shard *shard, struct cache_entry *entry);
+  /* ENTRY, already mapped, was accessed again */
+  void (*touch) (struct cache_shard *shard, struct cache_entry *entry);
+  /* ENTRY is about to be mapped to another sector */
+  void (*remove) (struct cache_shard *shard, struct cache_entry *entry);
 };
 
+static const struct cache_policy clock_policy;
+static const struct cache_policy twoq_policy;
+static const struct cache_policy *policy = &twoq_policy;  /* Policy in use */
+
+static thread_func flusher;
+static thread_func read_ahead;
+
+static hash_hash_func cache_hash;
+static hash_less_func cache_less;
+static hash_hash_func ghost_hash;
+static hash_less_func ghost_less;
+
+/* Number of pages holding the entries' metadata and data. */
+static size_t
+meta_pages (void)
+{
+  return DIV_ROUND_UP (cache_size * sizeof (struct cache_entry), PGSIZE);
+}
+
+static size_t
+data_pages (void)
+{
+  return DIV_ROUND_UP (cache_size * BLOCK_SECTOR_SIZE, PGSIZE);
+}
+
+/* Returns the shard that caches SECTOR. */
+static struct cache_shard *
+shard_of (block_sector_t sector)
+{
+  return &shards[sector % shard_cnt];
+}
+
+/* Returns the number of dirty entries across all shards.  The
+   shards are not locked, so the count is only approximate. */
+static size_t
+dirty_count (void)
+{
+  size_t cnt = 0;
+  size_t i;
+
+  for (i = 0; i < shard_cnt; i++)
+    cnt += shards[i].dirty_cnt;
+  return cnt;
+}
+
+/* Counts a lock acquisition that had to wait, starting at tick
+   START. */
+static void
+count_wait (int64_t start)
+{
+  int64_t elapsed = timer_elapsed(start);
+  enum intr_level old_level = intr_disable();
+  lock_waits++;
+  lock_wait_ticks += elapsed;
+  intr_set_level(old_level);
+}
+
+/* Acquires SHARD's lock, keeping track of any wait. */
+static void
+shard_lock (struct cache_shard *shard)
+{
+  if (!lock_try_acquire(&shard->lock)) {
+    int64_t start = timer_ticks();
+    lock_acquire(&shard->lock);
+    count_wait(start);
+  }
+}
+
+/* Acquires ENTRY's block_lock, for writing if EXCLUSIVE and for
+   reading otherwise, keeping track of any wait. */
+static void
+entry_lock (struct cache_entry *entry, bool exclusive)
+{
+  if (exclusive ? rwlock_try_acquire_write(&entry->block_lock)
+                : rwlock_try_acquire_read(&entry->block_lock))
+    return;
+
+  int64_t start = timer_ticks();
+  if (exclusive)
+    rwlock_acquire_write(&entry->block_lock);
+  else
+    rwlock_acquire_read(&entry->block_lock);
+  count_wait(start);
+}
+
+/* Sets the number of entries the cache will have to ENTRY_CNT.
+   Must be called before cache_init(). */
+void cache_configure(size_t entry_cnt){
+  if (entry_cnt == 0)
+    PANIC ("buffer cache must have at least one entry");
+  cache_size = entry_cnt;
+}
+
+/* Selects the replacement policy named NAME, either "2q" (the
+   default) or "clock".  Must be called before cache_init(). */
+void
+cache_set_policy (const char *name)
+{
+  if (!strcmp (name, twoq_policy.name))
+    policy = &twoq_policy;
+  else if (!strcmp (name, clock_policy.name))
+    policy = &clock_policy;
+  else
+    PANIC ("unknown cache policy \"%s\"", name);
+}
 
 /* Initialize the cache */
 void cache_init(void){
-  hand = 0;
-  lock_init(&cache_lock);
-  int i;
-  for (i = 0; i < CACHE_SIZE; i ++) {
-    struct cache_entry *entry = malloc(sizeof(struct cache_entry));
+  lock_init(&flush_lock);
+  list_init(&spilled);
+  lock_init(&spill_lock);
+
+  /* Keep the blocks in one page-aligned run, apart from the
+     small metadata array that lookups and the clock hand walk. */
+  entries = palloc_get_multiple(PAL_ZERO, meta_pages());
+  cache_data = palloc_get_multiple(0, data_pages());
+  flush_order = malloc(cache_size * sizeof *flush_order);
+  if (entries == NULL || cache_data == NULL || flush_order == NULL)
+    PANIC ("not enough kernel memory for a %zu-entry buffer cache",
+           cache_size);
+
+  /* Split the entries as evenly as possible between the shards. */
+  shard_cnt = cache_size < CACHE_SHARDS ? cache_size : CACHE_SHARDS;
+  size_t i, j;
+  for (i = 0; i < shard_cnt; i++) {
+    struct cache_shard *shard = &shards[i];
+    size_t first = i * cache_size / shard_cnt;
+    lock_init(&shard->lock);
+    hash_init(&shard->index, cache_hash, cache_less, NULL);
+    list_init(&shard->free_entries);
+    cond_init(&shard->entry_released);
+    shard->entries = &entries[first];
+    shard->size = (i + 1) * cache_size / shard_cnt - first;
+    shard->hand = 0;
+    shard->dirty_cnt = 0;
+
+    /* 2Q's recommended tuning: a quarter of the entries for
+       first-time sectors, and ghosts for half as many sectors
+       as there are entries. */
+    list_init(&shard->a1in);
+    list_init(&shard->am);
+    shard->a1in_cnt = 0;
+    shard->a1in_max = shard->size / 4 > 0 ? shard->size / 4 : 1;
+    shard->a1out_size = shard->size / 2 > 0 ? shard->size / 2 : 1;
+    shard->a1out_next = 0;
+    shard->a1out = malloc(shard->a1out_size * sizeof *shard->a1out);
+    if (shard->a1out == NULL)
+      PANIC ("not enough kernel memory for the buffer cache");
+    for (j = 0; j < shard->a1out_size; j++)
+      shard->a1out[j].sector = INVALID_SECTOR;
+    hash_init(&shard->ghosts, ghost_hash, ghost_less, NULL);
+    for (j = 0; j < shard->size; j++)
+      shard->entries[j].shard = shard;
+  }
+
+  for (i = 0; i < cache_size; i ++) {
+    struct cache_entry *entry = &entries[i];
     entry -> sector = INVALID_SECTOR;
     entry -> ref = false;
     entry -> dirty = false;
     entry -> up_to_date = false;
     entry -> use_count = 0;
-    
-    cond_init(&entry->block_cond);
-    lock_init(&entry->block_lock);
-    lock_init(&entry->data_lock);
+    entry -> prefetched = false;
+    entry -> held = false;
+    entry -> owner = INVALID_SECTOR;
+    entry -> queue = QUEUE_NONE;
+    entry -> data = cache_data + i * BLOCK_SECTOR_SIZE;
+    rwlock_init(&entry->block_lock);
 
-    entries[i] = entry;
+    list_push_back(&entry->shard->free_entries, &entry->elem);
   }
+
+  flusher_exit = false;
+  sema_init(&flusher_done, 0);
+  thread_create("flusher", PRI_DEFAULT, flusher, NULL);
+
+  ra_head = ra_cnt = 0;
+  lock_init(&ra_lock);
+  cond_init(&ra_queued);
+  read_ahead_exit = false;
+  sema_init(&read_ahead_done, 0);
+  thread_create("read-ahead", PRI_DEFAULT, read_ahead, NULL);
 }
 
 /* Close the cache */
 void cache_close(void){
-  int i;
-  for (i = 0; i < CACHE_SIZE; i++) {
-    /* If there's dirty block when we close the cache, write back. */
-    if (entries[i]->dirty && entries[i]->up_to_date) {
-      block_write (fs_device, entries[i]->sector, entries[i]->data);
-      entries[i]->dirty = false;
-    }
-    free(entries[i]);
+  lock_acquire(&ra_lock);
+  read_ahead_exit = true;
+  cond_signal(&ra_queued, &ra_lock);
+  lock_release(&ra_lock);
+  sema_down(&read_ahead_done);
+
+  /* Stop the flusher before writing back what it has not. */
+  flusher_exit = true;
+  sema_down(&flusher_done);
+  cache_flush();
+
+  size_t i;
+  for (i = 0; i < shard_cnt; i++) {
+    hash_destroy(&shards[i].index, NULL);
+    hash_destroy(&shards[i].ghosts, NULL);
+    free(shards[i].a1out);
   }
+  free(flush_order);
+  palloc_free_multiple(cache_data, data_pages());
+  palloc_free_multiple(entries, meta_pages());
+}
+
+/* Hashes an entry by the sector it maps to. */
+static unsigned
+cache_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_entry *entry = hash_entry (e, struct cache_entry, hash_elem);
+  return hash_int (entry->sector);
+}
+
+/* Orders entries by the sector they map to. */
+static bool
+cache_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return hash_entry (a, struct cache_entry, hash_elem)->sector
+         < hash_entry (b, struct cache_entry, hash_elem)->sector;
+}
+
+/* Hashes a ghost by its sector. */
+static unsigned
+ghost_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct cache_ghost, hash_elem)->sector);
+}
+
+/* Orders ghosts by their sectors. */
+static bool
+ghost_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return hash_entry (a, struct cache_ghost, hash_elem)->sector
+         < hash_entry (b, struct cache_ghost, hash_elem)->sector;
 }
 
-/* Retrieves the index cache entry corresponding to the block sector, should it exist; otherwise, it returns -1. */
-int cache_lookup(block_sector_t sector){
+/* Returns the entry mapped to SECTOR in SHARD, or NULL if it is
+   not cached.  The caller must hold SHARD's lock. */
+static struct cache_entry *
+cache_lookup (struct cache_shard *shard, block_sector_t sector)
+{
+  struct cache_entry key;
+  struct hash_elem *e;
 
+  key.sector = sector;
+  e = hash_find (&shard->index, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct cache_entry, hash_elem) : NULL;
+}
 
-  if ((&cache_lock)->holder == thread_current ()) {
-    ASSERT (false);
+/* Sets ENTRY's dirty flag to DIRTY, keeping its shard's dirty_cnt
+   in step.  The caller must hold both ENTRY's block_lock and its
+   shard's lock. */
+static void
+set_dirty (struct cache_entry *entry, bool dirty)
+{
+  if (entry->dirty != dirty) {
+    entry->dirty = dirty;
+    if (dirty)
+      entry->shard->dirty_cnt++;
+    else
+      entry->shard->dirty_cnt--;
   }
-  lock_acquire(&cache_lock);
+}
 
+/* Sets aside a copy of held ENTRY's block, which may not reach
+   its sector yet, so that the entry can be evicted.  Panics if
+   out of memory, since the block cannot be dropped.  The caller
+   must hold ENTRY's shard's lock. */
+static void
+spill (struct cache_entry *entry)
+{
+  struct spilled_block *b = malloc(sizeof *b);
 
-  int i;
-  for (i = 0; i < CACHE_SIZE; i++) {
-    if (entries[i]->sector == sector) {
+  if (b == NULL)
+    PANIC ("no memory to set aside held sector %"PRDSNu, entry->sector);
+  b->sector = entry->sector;
+  memcpy(b->data, entry->data, BLOCK_SECTOR_SIZE);
+  lock_acquire(&spill_lock);
+  list_push_back(&spilled, &b->elem);
+  lock_release(&spill_lock);
+}
 
+/* If SECTOR's block was set aside by spill(), copies it into DATA,
+   forgets it and returns true. */
+static bool
+unspill (block_sector_t sector, uint8_t *data)
+{
+  struct list_elem *e;
+  bool found = false;
 
-      if ((&entries[i]->block_lock)->holder == thread_current ()) {
-    ASSERT (false);
+  lock_acquire(&spill_lock);
+  for (e = list_begin(&spilled); e != list_end(&spilled); e = list_next(e)) {
+    struct spilled_block *b = list_entry(e, struct spilled_block, elem);
+    if (b->sector == sector) {
+      memcpy(data, b->data, BLOCK_SECTOR_SIZE);
+      list_remove(e);
+      free(b);
+      found = true;
+      break;
+    }
   }
-      lock_acquire(&entries[i]->block_lock);
+  lock_release(&spill_lock);
+  return found;
+}
 
+/* Writes back those of the CNT entries in RUN that are dirty and
+   not held.  The entries must be for consecutive sectors, at most
+   RUN_MAX of them, and each unbroken stretch of them goes to disk
+   as a single request.  The caller must hold their block_locks,
+   for reading or writing, but no shard lock.  Holding them for
+   reading is enough since only writers dirty or hold an entry. */
+static void
+write_run (struct cache_entry **run, size_t cnt)
+{
+  const void *buffers[RUN_MAX];
+  size_t i, j, n;
 
-      entries[i]->use_count += 1;
-      lock_release(&cache_lock);
-      return i;
+  ASSERT (cnt <= RUN_MAX);
+  for (i = 0; i < cnt; i += n) {
+    for (n = 0; i + n < cnt && run[i + n]->dirty && !run[i + n]->held; n++)
+      buffers[n] = run[i + n]->data;
+    if (n == 0) {
+      n = 1;
+      continue;
+    }
+    block_write_many(fs_device, run[i]->sector, n, buffers);
+    for (j = i; j < i + n; j++) {
+      shard_lock(run[j]->shard);
+      set_dirty(run[j], false);
+      run[j]->shard->stats.write_backs++;
+      lock_release(&run[j]->shard->lock);
     }
   }
-  lock_release(&cache_lock);
-  return -1;
 }
 
-int cache_create(void) {
+/* Writes ENTRY back to disk if it is dirty and not held, as
+   write_run() does. */
+static void
+write_back (struct cache_entry *entry)
+{
+  write_run(&entry, 1);
+}
+
+/* Picks an entry to hold a new sector: a free entry if there is
+   one, otherwise an unused entry chosen by the replacement
+   policy.  Returns NULL if every entry of SHARD is in use.  The
+   caller must hold SHARD's lock. */
+static struct cache_entry *
+cache_evict (struct cache_shard *shard)
+{
+  if (!list_empty (&shard->free_entries))
+    return list_entry (list_pop_front (&shard->free_entries),
+                       struct cache_entry, elem);
+  return policy->evict(shard);
+}
 
+/* Clock replacement.  Picks the first unused entry the hand
+   finds with its reference bit clear, clearing the bits it
+   passes over.  Clean entries are preferred, since the flusher
+   will soon write back the dirty ones; a dirty entry is only
+   returned if no clean one turned up. */
+static struct cache_entry *
+clock_evict (struct cache_shard *shard)
+{
+  struct cache_entry *dirty_victim = NULL;
 
-  if ((&cache_lock)->holder == thread_current ()) {
-    ASSERT (false);
+  size_t base;
+  for (base = 0; base < shard->size * 2; base++) {
+    struct cache_entry *entry = &shard->entries[shard->hand];
+    shard->hand = (shard->hand + 1) % shard->size;
+    if (entry->use_count > 0)
+      continue;
+    if (entry->ref) {
+      entry->ref = false;
+      continue;
+    }
+    if (!entry->dirty)
+      return entry;
+    if (dirty_victim == NULL)
+      dirty_victim = entry;
   }
-  lock_acquire(&cache_lock);
+  return dirty_victim;
+}
 
+static void
+clock_touch (struct cache_shard *shard UNUSED, struct cache_entry *entry)
+{
+  entry->ref = true;
+}
 
-  /* Find the empty block first. */
-  int i;
-  for (i = 0; i < CACHE_SIZE; i++) {
-    if (entries[i]->sector == INVALID_SECTOR) {
+static void
+clock_remove (struct cache_shard *shard UNUSED,
+              struct cache_entry *entry UNUSED)
+{
+}
+
+static const struct cache_policy clock_policy = {
+  "clock", clock_evict, clock_touch, clock_touch, clock_remove
+};
 
+/* 2Q replacement (Johnson and Shasha, VLDB 1994).  A sector
+   enters a1in when it is mapped and stays there however often it
+   is accessed, so a long scan only ever churns through a1in.  If
+   a sector comes back soon after falling out of a1in, as told by
+   the a1out ghosts, it is considered hot and goes on am, an LRU
+   list that a scan cannot flush. */
 
-      if ((&entries[i]->block_lock)->holder == thread_current ()) {
-    ASSERT (false);
+/* Returns the least recently queued unused entry of QUEUE,
+   preferring clean entries as clock_evict() does, or NULL. */
+static struct cache_entry *
+twoq_oldest (struct list *queue)
+{
+  struct cache_entry *dirty_victim = NULL;
+  struct list_elem *e;
+
+  for (e = list_rbegin (queue); e != list_rend (queue); e = list_prev (e)) {
+    struct cache_entry *entry = list_entry (e, struct cache_entry, elem);
+    if (entry->use_count > 0)
+      continue;
+    if (!entry->dirty)
+      return entry;
+    if (dirty_victim == NULL)
+      dirty_victim = entry;
   }
-      lock_acquire(&entries[i]->block_lock);
+  return dirty_victim;
+}
 
+/* Evicts from a1in while it is over its share, then from am. */
+static struct cache_entry *
+twoq_evict (struct cache_shard *shard)
+{
+  struct cache_entry *victim = NULL;
 
-      entries[i]->use_count += 1;
-      lock_release(&cache_lock);
-      return i;
+  if (shard->a1in_cnt > shard->a1in_max)
+    victim = twoq_oldest(&shard->a1in);
+  if (victim == NULL)
+    victim = twoq_oldest(&shard->am);
+  if (victim == NULL)
+    victim = twoq_oldest(&shard->a1in);
+  return victim;
+}
+
+/* Queues a newly mapped ENTRY on am if its sector has a ghost in
+   a1out, otherwise on a1in.  The ghost is looked up in the
+   shard's ghosts, so misses do not scan the ring. */
+static void
+twoq_insert (struct cache_shard *shard, struct cache_entry *entry)
+{
+  struct cache_ghost key;
+  struct hash_elem *e;
+
+  key.sector = entry->sector;
+  e = hash_delete(&shard->ghosts, &key.hash_elem);
+  if (e != NULL) {
+    hash_entry(e, struct cache_ghost, hash_elem)->sector = INVALID_SECTOR;
+    entry->queue = QUEUE_AM;
+    list_push_front(&shard->am, &entry->elem);
+    return;
+  }
+
+  entry->queue = QUEUE_A1IN;
+  list_push_front(&shard->a1in, &entry->elem);
+  shard->a1in_cnt++;
+}
+
+/* Moves ENTRY to the front of am if it is there.  Entries on a1in
+   stay put, so that a burst of accesses to a sector read once
+   does not make it look hot. */
+static void
+twoq_touch (struct cache_shard *shard, struct cache_entry *entry)
+{
+  if (entry->queue == QUEUE_AM) {
+    list_remove(&entry->elem);
+    list_push_front(&shard->am, &entry->elem);
+  }
+}
+
+/* Takes ENTRY off its queue, remembering its sector in a1out if
+   it never made it to am. */
+static void
+twoq_remove (struct cache_shard *shard, struct cache_entry *entry)
+{
+  if (entry->queue == QUEUE_NONE)
+    return;
+  list_remove(&entry->elem);
+  if (entry->queue == QUEUE_A1IN) {
+    struct cache_ghost *ghost = &shard->a1out[shard->a1out_next];
+    struct hash_elem *old;
+
+    shard->a1in_cnt--;
+    if (ghost->sector != INVALID_SECTOR)
+      hash_delete(&shard->ghosts, &ghost->hash_elem);
+    ghost->sector = entry->sector;
+    old = hash_replace(&shard->ghosts, &ghost->hash_elem);
+    if (old != NULL)
+      hash_entry(old, struct cache_ghost, hash_elem)->sector = INVALID_SECTOR;
+    shard->a1out_next = (shard->a1out_next + 1) % shard->a1out_size;
+  }
+  entry->queue = QUEUE_NONE;
+}
+
+static const struct cache_policy twoq_policy = {
+  "2q", twoq_evict, twoq_insert, twoq_touch, twoq_remove
+};
+
+/* Maps victim ENTRY of SHARD, picked by cache_evict() and clean
+   unless held, to SECTOR.  The caller must hold SHARD's lock. */
+static void
+map_entry (struct cache_shard *shard, struct cache_entry *entry,
+           block_sector_t sector, bool prefetch)
+{
+  if (entry->sector != INVALID_SECTOR) {
+    /* A held victim may not reach its sector yet, so its block
+       is set aside in memory instead.  No one has it pinned, so
+       it cannot change meanwhile. */
+    if (entry->held) {
+      spill(entry);
+      set_dirty(entry, false);
     }
+    policy->remove(shard, entry);
+    hash_delete(&shard->index, &entry->hash_elem);
+    shard->stats.evictions++;
+  }
+  entry->sector = sector;
+  entry->up_to_date = false;
+  entry->prefetched = prefetch;
+  entry->owner = INVALID_SECTOR;
+  /* A held sector evicted earlier comes back from memory, still
+     held, rather than from its stale copy on disk. */
+  entry->held = unspill(sector, entry->data);
+  if (entry->held) {
+    entry->up_to_date = true;
+    set_dirty(entry, true);
   }
+  hash_insert(&shard->index, &entry->hash_elem);
+  policy->insert(shard, entry);
+  if (prefetch)
+    shard->stats.read_aheads++;
+  else
+    shard->stats.misses++;
+}
+
+/* Returns the entry for SECTOR, mapping the sector to a new entry
+   if it is not cached yet.  With EXCLUSIVE the entry's block_lock
+   is held for writing, and a newly mapped entry is not up to date;
+   the caller fills it in.  Otherwise the lock is held for reading
+   and the entry has been read from disk if need be.  PREFETCH is
+   set by the read-ahead thread, whose accesses are kept out of
+   the hit and miss counts. */
+static struct cache_entry *
+cache_acquire (block_sector_t sector, bool exclusive, bool prefetch)
+{
+  struct cache_shard *shard = shard_of(sector);
+  struct cache_entry *entry;
+
+  shard_lock(shard);
+  for (;;) {
+    entry = cache_lookup(shard, sector);
+    if (entry != NULL) {
+      policy->touch(shard, entry);
+      if (!prefetch) {
+        shard->stats.hits++;
+        if (entry->prefetched) {
+          shard->stats.read_ahead_hits++;
+          entry->prefetched = false;
+        }
+      }
+      break;
+    }
 
-  /* If there's no empty block, use clock algorithm to evict a block. */
-  int base;
-  for (base = 0; base < CACHE_SIZE * 2; base++) {
-    if (entries[hand]->use_count > 0) {
+    entry = cache_evict(shard);
+    if (entry == NULL) {
+      cond_wait(&shard->entry_released, &shard->lock);
       continue;
     }
-    if (entries[hand]->ref == false) {
-      entries[hand]->ref = true;
-      hand = (hand + 1) % CACHE_SIZE;
+
+    if (entry->dirty && !entry->held) {
+      /* Write the victim back without holding the shard lock.  It stays
+         mapped to its old sector meanwhile, so readers of that
+         sector still find it cached instead of reading stale data
+         from disk.  Then start over, since SECTOR may have been
+         cached by someone else in the meantime. */
+      entry->use_count += 1;
+      lock_release(&shard->lock);
+      entry_lock(entry, false);
+      write_back(entry);
+      rwlock_release_read(&entry->block_lock);
+      shard_lock(shard);
+      if (--entry->use_count == 0)
+        cond_signal(&shard->entry_released, &shard->lock);
       continue;
     }
 
+    map_entry(shard, entry, sector, prefetch);
+    break;
+  }
+  entry->use_count += 1;
+  lock_release(&shard->lock);
+
+  if (exclusive) {
+    entry_lock(entry, true);
+    return entry;
+  }
+
+  entry_lock(entry, false);
+  if (!entry->up_to_date) {
+    /* Readers cannot fill in the entry, so load it as a writer
+       and come back.  The pin keeps the entry mapped to SECTOR
+       meanwhile, and once up to date it stays that way. */
+    rwlock_release_read(&entry->block_lock);
+    entry_lock(entry, true);
+    if (!entry->up_to_date) {
+      block_read(fs_device, sector, entry->data);
+      entry->up_to_date = true;
+    }
+    rwlock_release_write(&entry->block_lock);
+    entry_lock(entry, false);
+  }
+  return entry;
+}
+
+/* Releases an entry obtained from cache_acquire(), in whichever
+   mode it was acquired, marking it dirty if DIRTIED.  Only a
+   writer may dirty an entry. */
+static void
+cache_release (struct cache_entry *entry, bool dirtied)
+{
+  struct cache_shard *shard = entry->shard;
+  bool exclusive = rwlock_held_by_current_thread(&entry->block_lock);
+
+  ASSERT (exclusive || !dirtied);
+  shard_lock(shard);
+  if (dirtied)
+    set_dirty(entry, true);
+  if (--entry->use_count == 0)
+    cond_signal(&shard->entry_released, &shard->lock);
+  lock_release(&shard->lock);
+  if (exclusive)
+    rwlock_release_write(&entry->block_lock);
+  else
+    rwlock_release_read(&entry->block_lock);
+}
+
+/* Orders pointers to cache entries by sector, for qsort(). */
+static int
+compare_sectors (const void *a_, const void *b_)
+{
+  const struct cache_entry *a = *(struct cache_entry * const *) a_;
+  const struct cache_entry *b = *(struct cache_entry * const *) b_;
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes the dirty entries that are not held back to disk: all
+   of them if ALL, otherwise those holding data of the file whose
+   inode is in OWNER.  Entries go out in ascending sector order, so
+   runs of adjacent sectors reach the disk back to back instead of
+   in eviction order. */
+static void
+flush_entries (bool all, block_sector_t owner)
+{
+  size_t cnt = 0;
+  size_t i, j;
 
-    if ((&entries[hand]->block_lock)->holder == thread_current ()) {
-    ASSERT (false);
+  lock_acquire(&flush_lock);
+  for (i = 0; i < shard_cnt; i++) {
+    struct cache_shard *shard = &shards[i];
+
+    shard_lock(shard);
+    for (j = 0; j < shard->size; j++)
+      if (shard->entries[j].dirty && !shard->entries[j].held
+          && (all || shard->entries[j].owner == owner)) {
+        /* Pinning keeps the entry mapped to its sector. */
+        shard->entries[j].use_count += 1;
+        flush_order[cnt++] = &shard->entries[j];
+      }
+    lock_release(&shard->lock);
+  }
+
+  qsort(flush_order, cnt, sizeof *flush_order, compare_sectors);
+  for (i = 0; i < cnt; i = j) {
+    size_t k;
+
+    /* Entries for adjacent sectors go out in one request. */
+    for (j = i + 1; j < cnt && j - i < RUN_MAX
+         && flush_order[j]->sector == flush_order[j - 1]->sector + 1; j++)
+      continue;
+    for (k = i; k < j; k++)
+      entry_lock(flush_order[k], false);
+    write_run(flush_order + i, j - i);
+    for (k = i; k < j; k++)
+      cache_release(flush_order[k], false);
   }
-    lock_acquire(&entries[hand]->block_lock);
+  lock_release(&flush_lock);
+}
 
+/* Writes every dirty entry that is not held back to disk. */
+void
+cache_flush (void)
+{
+  enum intr_level old_level = intr_disable();
+  flushes++;
+  flushes_running++;
+  intr_set_level(old_level);
 
-    entries[hand]->use_count += 1;
-    lock_release(&cache_lock);
+  flush_entries(true, INVALID_SECTOR);
 
-    /* If we are evicting a dirty block, write it back first. */
-    if (entries[hand]->dirty && entries[hand]->up_to_date) {
-      block_write (fs_device, entries[hand]->sector, entries[hand]->data);
+  old_level = intr_disable();
+  flushes_running--;
+  intr_set_level(old_level);
+}
+
+/* Writes back the dirty data of the file whose inode is in OWNER,
+   as written by cache_write_owned(), leaving other entries be. */
+void
+cache_flush_owner (block_sector_t owner)
+{
+  flush_entries(false, owner);
+}
+
+/* Write-behind thread.  Flushes the cache every FLUSH_INTERVAL
+   ticks, or sooner once DIRTY_HIGH_PCT of the entries are dirty,
+   so that eviction rarely has to wait for a write. */
+static void
+flusher (void *aux UNUSED)
+{
+  int64_t last_flush = timer_ticks();
+
+  while (!flusher_exit) {
+    timer_sleep(FLUSH_POLL);
+    if (timer_elapsed(last_flush) >= FLUSH_INTERVAL
+        || dirty_count() * 100 >= cache_size * DIRTY_HIGH_PCT) {
+      cache_flush();
+      last_flush = timer_ticks();
     }
-    return hand;
   }
-  lock_release(&cache_lock);
-  return -1;
+  sema_up(&flusher_done);
 }
 
+/* Returns the entry whose data block DATA points to. */
+static struct cache_entry *
+data_to_entry (const void *data)
+{
+  size_t ofs = (const uint8_t *) data - cache_data;
 
-void cache_read_many(block_sector_t sector, void * buf, off_t buf_ofs, off_t sector_ofs, size_t length){
-  
-  /* First find if the block is in the cache. */
-  int i = cache_lookup(sector);
-  /* If not in cache, create a new one. */
-  if (i == -1) {
-    i = cache_create();
-    entries[i]->up_to_date = false;
+  ASSERT (ofs < cache_size * BLOCK_SECTOR_SIZE);
+  ASSERT (ofs % BLOCK_SECTOR_SIZE == 0);
+  return &entries[ofs / BLOCK_SECTOR_SIZE];
+}
+
+/* Pins SECTOR in the cache and returns a pointer to its
+   BLOCK_SECTOR_SIZE bytes, so that callers can work on them in
+   place instead of copying the whole sector.  With CACHE_READ
+   the data may only be read, and other readers may pin the
+   sector at the same time.  With CACHE_WRITE the caller has the
+   sector to itself and may modify it, and with CACHE_OVERWRITE
+   likewise, except that a sector not yet cached is not read in
+   since the caller replaces all of it.  The pointer stays valid
+   until it is passed to cache_put().  A thread should not pin
+   more than one sector at a time, since with a small cache two
+   such threads could wait on each other forever. */
+void *
+cache_get (block_sector_t sector, enum cache_mode mode)
+{
+  struct cache_entry *entry = cache_acquire(sector, mode != CACHE_READ, false);
+
+  if (entry->up_to_date == false) {
+    if (mode != CACHE_OVERWRITE)
+      block_read(fs_device, sector, entry->data);
+    entry->up_to_date = true;
   }
+  return entry->data;
+}
+
+/* Unpins the sector whose data cache_get() returned as DATA,
+   marking it dirty if DIRTY.  Only a CACHE_WRITE pin may be put
+   back dirty, after which the sector no longer counts as any
+   file's data for cache_flush_owner(). */
+void
+cache_put (const void *data, bool dirty)
+{
+  struct cache_entry *entry = data_to_entry(data);
 
-  entries[i]->sector = sector;
-  entries[i]->ref = false;
-  if (entries[i]->up_to_date == false) {
-    block_read(fs_device, sector, entries[i]->data);
-    entries[i]->dirty = false;
-    entries[i]->up_to_date = true;
+  if (dirty) {
+    shard_lock(entry->shard);
+    entry->owner = INVALID_SECTOR;
+    lock_release(&entry->shard->lock);
   }
+  cache_release(entry, dirty);
+}
 
-  memcpy (buf + buf_ofs, entries[i]->data + sector_ofs, length);
-  entries[i]->use_count -= 1;
-  lock_release(&entries[i]->block_lock);
+/* Holds the sector pinned with CACHE_WRITE as DATA: once put back
+   dirty, it is not written to disk, by the flusher or to evict
+   it, until cache_unhold().  This lets a journal keep changes
+   away from their sectors until it has logged them.  Returns
+   false if the sector was already held. */
+bool
+cache_hold (const void *data)
+{
+  struct cache_entry *entry = data_to_entry(data);
+  bool was_held;
+
+  ASSERT (rwlock_held_by_current_thread(&entry->block_lock));
+  shard_lock(entry->shard);
+  was_held = entry->held;
+  entry->held = true;
+  lock_release(&entry->shard->lock);
+  return !was_held;
+}
+
+/* Lets SECTOR, held by cache_hold(), be written back like any
+   other dirty sector. */
+void
+cache_unhold (block_sector_t sector)
+{
+  struct cache_entry *entry = cache_acquire(sector, true, false);
+
+  shard_lock(entry->shard);
+  entry->held = false;
+  lock_release(&entry->shard->lock);
+  cache_release(entry, false);
+}
+
+/* Maps SECTOR to an entry for read-ahead or cache_read_run() and
+   returns the entry, pinned and locked for writing, for read_run()
+   to fill in.
+   Returns a null pointer instead if SECTOR is already cached.
+   Also returns a null pointer, and sets *BUSY, if no clean entry
+   is free to take at once: the caller may have other entries
+   pinned, so it must not wait for one or write one back here.
+   PREFETCH is as for cache_acquire(), clear for a reader that
+   wants SECTOR at once. */
+static struct cache_entry *
+prefetch_entry (block_sector_t sector, bool prefetch, bool *busy)
+{
+  struct cache_shard *shard = shard_of(sector);
+  struct cache_entry *entry = NULL;
+
+  *busy = false;
+  shard_lock(shard);
+  if (cache_lookup(shard, sector) == NULL) {
+    entry = cache_evict(shard);
+    if (entry != NULL && entry->dirty)
+      entry = NULL;
+    if (entry != NULL) {
+      map_entry(shard, entry, sector, prefetch);
+      entry->use_count += 1;
+    }
+    else
+      *busy = true;
+  }
+  lock_release(&shard->lock);
+  if (entry == NULL)
+    return NULL;
+
+  /* Someone may have filled in the entry before we locked it. */
+  entry_lock(entry, true);
+  if (entry->up_to_date) {
+    cache_release(entry, false);
+    return NULL;
+  }
+  return entry;
+}
+
+/* Reads the CNT sectors of the entries in RUN, which are for
+   consecutive sectors and come from prefetch_entry(), with a
+   single request.  The entries stay pinned. */
+static void
+read_run (struct cache_entry **run, size_t cnt)
+{
+  void *buffers[RUN_MAX];
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    buffers[i] = run[i]->data;
+  block_read_many(fs_device, run[0]->sector, cnt, buffers);
+  for (i = 0; i < cnt; i++)
+    run[i]->up_to_date = true;
+}
+
+/* Queues SECTOR to be read into the cache in the background.
+   Returns at once; the request is dropped if the queue is full,
+   since read-ahead is only a hint. */
+void
+cache_read_ahead (block_sector_t sector)
+{
+  lock_acquire(&ra_lock);
+  if (ra_cnt < READ_AHEAD_SLOTS) {
+    ra_queue[(ra_head + ra_cnt++) % READ_AHEAD_SLOTS] = sector;
+    cond_signal(&ra_queued, &ra_lock);
+  }
+  lock_release(&ra_lock);
+}
+
+/* Read-ahead thread.  Loads queued sectors into the cache so that
+   sequential readers find them there instead of waiting on the
+   disk one sector at a time. */
+static void
+read_ahead (void *aux UNUSED)
+{
+  for (;;) {
+    struct cache_entry *run[READ_AHEAD_RUN];
+    block_sector_t sector;
+    size_t cnt, n, i, j;
+
+    /* Take the next sector off the queue, along with a few queued
+       right behind it that follow it on disk.  Taking many at once
+       gets ahead of the reader by so much that the cache evicts
+       them again before they are used. */
+    lock_acquire(&ra_lock);
+    while (ra_cnt == 0 && !read_ahead_exit)
+      cond_wait(&ra_queued, &ra_lock);
+    if (read_ahead_exit) {
+      lock_release(&ra_lock);
+      break;
+    }
+    sector = ra_queue[ra_head];
+    cnt = 0;
+    do {
+      ra_head = (ra_head + 1) % READ_AHEAD_SLOTS;
+      ra_cnt--;
+      cnt++;
+    } while (ra_cnt > 0 && cnt < READ_AHEAD_RUN
+             && ra_queue[ra_head] == sector + cnt);
+    lock_release(&ra_lock);
+
+    /* Read each stretch of them that could be mapped at once with
+       one request.  A sector that has to wait for an entry is read
+       on its own once the stretch before it is done. */
+    n = 0;
+    for (i = 0; i <= cnt; i++) {
+      bool busy = false;
+      struct cache_entry *entry = NULL;
+
+      if (i < cnt)
+        entry = prefetch_entry(sector + i, true, &busy);
+      if (entry != NULL) {
+        run[n++] = entry;
+        continue;
+      }
+      if (n > 0) {
+        read_run(run, n);
+        for (j = 0; j < n; j++)
+          cache_release(run[j], false);
+        n = 0;
+      }
+      if (busy) {
+        entry = cache_acquire(sector + i, true, true);
+        if (!entry->up_to_date) {
+          block_read(fs_device, sector + i, entry->data);
+          entry->up_to_date = true;
+        }
+        cache_release(entry, false);
+      }
+    }
+  }
+  sema_up(&read_ahead_done);
+}
+
+void cache_read_many(block_sector_t sector, void * buf, off_t buf_ofs, off_t sector_ofs, size_t length){
+  struct cache_entry *entry = cache_acquire(sector, false, false);
+  memcpy (buf + buf_ofs, entry->data + sector_ofs, length);
+  cache_release(entry, false);
+}
+
+/* Finds the part of sector J of a request for LENGTH bytes from
+   SECTOR_OFS bytes into its first sector on: stores where the
+   part starts within the sector in *OFS and within the request in
+   *POS, and returns its length. */
+static size_t
+run_part (size_t j, off_t sector_ofs, size_t length, off_t *ofs, off_t *pos)
+{
+  size_t size;
+
+  *ofs = j == 0 ? sector_ofs : 0;
+  *pos = (off_t) j * BLOCK_SECTOR_SIZE + *ofs - sector_ofs;
+  size = BLOCK_SECTOR_SIZE - *ofs;
+  return size < length - *pos ? size : length - *pos;
+}
+
+/* Like cache_read_many(), for LENGTH bytes that may go on past
+   SECTOR into the sectors following it on disk, as within an
+   extent of a file.  Each stretch of those sectors that is not
+   cached yet is read with a single request, instead of one
+   request per sector. */
+void
+cache_read_run (block_sector_t sector, void *buf, off_t buf_ofs,
+                off_t sector_ofs, size_t length)
+{
+  struct cache_entry *run[RUN_MAX];
+  size_t cnt = DIV_ROUND_UP(sector_ofs + length, BLOCK_SECTOR_SIZE);
+  size_t i = 0, n, j, size;
+  off_t ofs, pos;
+  bool busy;
+
+  while (i < cnt) {
+    /* Map as many of the sectors from the I'th on as are not
+       cached yet, and read them with one request. */
+    n = 0;
+    while (i + n < cnt && n < RUN_MAX
+           && (run[n] = prefetch_entry(sector + i + n, false, &busy)) != NULL)
+      n++;
+    if (n == 0) {
+      /* Cached already, or no entry to be had without waiting. */
+      size = run_part(i, sector_ofs, length, &ofs, &pos);
+      cache_read_many(sector + i, buf, buf_ofs + pos, ofs, size);
+      i++;
+      continue;
+    }
+
+    read_run(run, n);
+    for (j = 0; j < n; j++) {
+      size = run_part(i + j, sector_ofs, length, &ofs, &pos);
+      memcpy(buf + buf_ofs + pos, run[j]->data + ofs, size);
+      cache_release(run[j], false);
+    }
+    i += n;
+  }
 }
 
 void cache_read(block_sector_t sector, void * buf) {
   cache_read_many(sector, buf, 0, 0, BLOCK_SECTOR_SIZE);
 }
 
-void cache_write_many(block_sector_t sector,const void * buf, off_t buf_ofs, off_t sector_ofs, size_t length){
-  int i = cache_lookup(sector);
-  if (i == -1) {
-    i = cache_create();
-  }
-  entries[i]->sector = sector;
-  entries[i]->ref = false;
-  entries[i]->dirty = true;
-  entries[i]->up_to_date = true;
+void cache_write_owned(block_sector_t owner, block_sector_t sector, const void * buf, off_t buf_ofs, off_t sector_ofs, size_t length){
+  struct cache_entry *entry = cache_acquire(sector, true, false);
+  /* A partial write must not clobber the rest of the sector. */
+  if (entry->up_to_date == false && length < BLOCK_SECTOR_SIZE)
+    block_read(fs_device, sector, entry->data);
+  entry->up_to_date = true;
 
-  memcpy (entries[i]->data + sector_ofs, buf + buf_ofs, length);
-  entries[i]->use_count -= 1;
-  lock_release(&entries[i]->block_lock);
+  memcpy (entry->data + sector_ofs, buf + buf_ofs, length);
+  shard_lock(entry->shard);
+  entry->owner = owner;
+  lock_release(&entry->shard->lock);
+  cache_release(entry, true);
+}
+void cache_write_many(block_sector_t sector,const void * buf, off_t buf_ofs, off_t sector_ofs, size_t length){
+  cache_write_owned(INVALID_SECTOR, sector, buf, buf_ofs, sector_ofs, length);
 }
 
 void cache_write(block_sector_t sector, const void * buf) {
   cache_write_many(sector, buf, 0, 0, BLOCK_SECTOR_SIZE);
 }
+
+/* Stores the sum of the counters of all shards in STATS. */
+void
+cache_get_stats (struct cache_stats *stats)
+{
+  size_t i;
+
+  memset(stats, 0, sizeof *stats);
+  for (i = 0; i < shard_cnt; i++) {
+    struct cache_shard *shard = &shards[i];
+
+    shard_lock(shard);
+    stats->hits += shard->stats.hits;
+    stats->misses += shard->stats.misses;
+    stats->evictions += shard->stats.evictions;
+    stats->write_backs += shard->stats.write_backs;
+    stats->read_aheads += shard->stats.read_aheads;
+    stats->read_ahead_hits += shard->stats.read_ahead_hits;
+    lock_release(&shard->lock);
+  }
+
+  enum intr_level old_level = intr_disable();
+  stats->lock_waits = lock_waits;
+  stats->lock_wait_ticks = lock_wait_ticks;
+  stats->flushes = flushes;
+  intr_set_level(old_level);
+}
+
+/* Sets all counters back to zero, except that flush passes still
+   in progress are counted, so that a nonzero flushes tells that
+   a pass may have written back entries since. */
+void
+cache_reset_stats (void)
+{
+  size_t i;
+
+  for (i = 0; i < shard_cnt; i++) {
+    shard_lock(&shards[i]);
+    memset(&shards[i].stats, 0, sizeof shards[i].stats);
+    lock_release(&shards[i].lock);
+  }
+
+  enum intr_level old_level = intr_disable();
+  lock_waits = lock_wait_ticks = 0;
+  flushes = flushes_running;
+  intr_set_level(old_level);
+}
+
+/* Prints cache statistics. */
+void
+cache_print_stats (void)
+{
+  struct cache_stats stats;
+
+  cache_get_stats(&stats);
+  printf ("Cache: %llu hits, %llu misses, %llu evictions, %llu write-backs "
+          "(%llu flushes)\n", stats.hits, stats.misses, stats.evictions,
+          stats.write_backs, stats.flushes);
+  printf ("Cache: %llu read-aheads (%llu used), %llu lock waits (%llu ticks)\n",
+          stats.read_aheads, stats.read_ahead_hits, stats.lock_waits,
+          stats.lock_wait_ticks);
+}
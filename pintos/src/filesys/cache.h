@@ -2,23 +2,28 @@
 #define FILESYS_CACHE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <cache-stats.h>
 #include "devices/block.h"
 #include "filesys/off_t.h"
 
+/* Set the number of cache entries, before cache_init() */
+void cache_configure(size_t entry_cnt);
+
+/* Select the replacement policy by name, before cache_init() */
+void cache_set_policy(const char *name);
+
 /* Initialize the cache */
 void cache_init(void);
 
 /* close the cache */
 void cache_close(void);
 
-/* Retrieves the index cache entry corresponding to the block sector, should it exist; otherwise, it returns -1. */
-int cache_lookup(block_sector_t sector);
-
-// /* Release the cache and its lock */
-// void cache_release(block_sector_t sector, bool dirty);
+/* Write all dirty blocks back to disk */
+void cache_flush(void);
 
- /* Create a new cache block and return its index. If all in used, return -1. */
-int cache_create(void);
+/* Write the dirty blocks of one file's data back to disk */
+void cache_flush_owner(block_sector_t owner);
 
 /* Reads data from a sector into the buffer, starting at the offset. Returns the number of bytes read.*/
 // void cache_read(block_sector_t sector, void * buf, off_t offset, size_t length);
@@ -26,9 +31,40 @@ void cache_read(block_sector_t sector, void * buf);
 
 void cache_read_many(block_sector_t sector, void * buf, off_t buf_ofs, off_t sector_ofs, size_t length);
 
+/* Like cache_read_many(), for data that may run on into the sectors following SECTOR on disk */
+void cache_read_run(block_sector_t sector, void * buf, off_t buf_ofs, off_t sector_ofs, size_t length);
+
+/* Ways of pinning a sector with cache_get() */
+enum cache_mode
+  {
+    CACHE_READ,                 /* Read only, shared with other readers */
+    CACHE_WRITE,                /* Modify in place, exclusively */
+    CACHE_OVERWRITE             /* Like CACHE_WRITE, but replacing all of
+                                   the sector, so not read from disk */
+  };
+
+/* Pin a sector and return its data in place, until cache_put() */
+void *cache_get(block_sector_t sector, enum cache_mode mode);
+void cache_put(const void *data, bool dirty);
+
+/* Keep a sector pinned for writing off the disk until unheld */
+bool cache_hold(const void *data);
+void cache_unhold(block_sector_t sector);
+
+/* Queue a sector to be read into the cache in the background */
+void cache_read_ahead(block_sector_t sector);
+
 /* Reads data from a buffer into a sector, starting at the offset. Returns the number of bytes written.*/
 void cache_write(block_sector_t sector, const void * buf);
 
 void cache_write_many(block_sector_t sector, const void * buf, off_t buf_ofs, off_t sector_ofs, size_t length);
 
+/* Like cache_write_many(), for data of the file whose inode is in owner */
+void cache_write_owned(block_sector_t owner, block_sector_t sector, const void * buf, off_t buf_ofs, off_t sector_ofs, size_t length);
+
+/* Counters on how well the cache is doing */
+void cache_get_stats(struct cache_stats *stats);
+void cache_reset_stats(void);
+void cache_print_stats(void);
+
 #endif /* filesys/cache.h */
@@ -1,12 +1,37 @@
 #include "filesys/directory.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 
+/* A directory file is a sequence of sector-sized blocks.  Block 0
+   is the root of a hash index, which maps ranges of name hashes to
+   the leaf blocks that hold the entries themselves, either
+   directly or through one level of index blocks below it.  Blocks
+   are only ever appended, and leaves are split as they fill, so
+   finding, adding or removing a name reads at most three blocks
+   however large the directory grows.
+
+   Directories on disks of format version 0 are instead a flat
+   array of entries, without an index.  Those are still searched
+   and changed in place, one entry at a time.  See
+   FILESYS_VERSION. */
+
+/* Identify index and leaf blocks. */
+#define DIR_INDEX_MAGIC 0x58444e49
+#define DIR_LEAF_MAGIC 0x4641454c
+
+/* Number of levels of index blocks above the leaves. */
+#define DIR_MAX_LEVELS 2
+
 /* A single directory entry. */
 struct dir_entry
   {
@@ -16,40 +41,269 @@ struct dir_entry
     bool is_dir;                        /* Is directory or file */
   };
 
+/* Entry in an index block: names whose hash is at least HASH,
+   and less than that of the next entry, are found through
+   BLOCK. */
+struct dir_index_entry
+  {
+    uint32_t hash;                      /* Least hash covered. */
+    uint32_t block;                     /* Leaf or lower index block. */
+  };
+
+#define INDEX_ENTRIES ((BLOCK_SECTOR_SIZE - 2 * sizeof (uint32_t)) \
+                       / sizeof (struct dir_index_entry))
+#define LEAF_ENTRIES ((BLOCK_SECTOR_SIZE - 2 * sizeof (uint32_t)) \
+                      / sizeof (struct dir_entry))
+
+/* An index block.  The first entry's hash is always 0 in the
+   root, so that every hash falls in some range. */
+struct dir_index
+  {
+    uint32_t magic;                     /* DIR_INDEX_MAGIC. */
+    uint16_t count;                     /* Entries in use. */
+    uint16_t depth;                     /* Levels below the root. */
+    struct dir_index_entry entries[INDEX_ENTRIES];
+  };
+
+/* A leaf block. */
+struct dir_leaf
+  {
+    uint32_t magic;                     /* DIR_LEAF_MAGIC. */
+    uint32_t unused;                    /* Not used. */
+    struct dir_entry entries[LEAF_ENTRIES];
+  };
+
+/* The blocks read on the way from the root of a directory's index
+   to the leaf for some hash. */
+struct dir_path
+  {
+    struct dir_index index[DIR_MAX_LEVELS]; /* Index blocks, root first. */
+    uint32_t index_block[DIR_MAX_LEVELS];   /* Their block numbers. */
+    int pos[DIR_MAX_LEVELS];                /* Entry followed in each. */
+    int levels;                             /* Number of index blocks. */
+    struct dir_leaf leaf;                   /* The leaf. */
+    uint32_t leaf_block;                    /* Its block number. */
+  };
+
+/* Number of names kept in the dentry cache. */
+#define DCACHE_SIZE 128
+
+/* A cached result of looking up NAME in the directory whose inode
+   is in sector PARENT.  A SECTOR of 0, which no file can have,
+   records that the name does not exist. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dcache_hash. */
+    struct list_elem lru_elem;          /* Element in dcache_lru. */
+    bool valid;                         /* In dcache_hash? */
+    block_sector_t parent;              /* Directory's inode sector. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    block_sector_t sector;              /* Inode sector, or 0. */
+  };
+
+static struct dentry dentries[DCACHE_SIZE];
+static struct hash dcache_hash;         /* Valid dentries by name. */
+static struct list dcache_lru;          /* All dentries, most recent first. */
+static struct lock dcache_lock;         /* Protects the dentry cache. */
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+static bool lookup (const struct dir *, const char *name,
+                    struct dir_entry *, off_t *);
+
+/* Initializes the directory module's dentry cache. */
+void
+dir_init (void)
+{
+  size_t i;
+
+  if (!hash_init (&dcache_hash, dentry_hash, dentry_less, NULL))
+    PANIC ("dentry cache initialization failed");
+  list_init (&dcache_lru);
+  lock_init (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    {
+      dentries[i].valid = false;
+      list_push_back (&dcache_lru, &dentries[i].lru_elem);
+    }
+}
+
+/* Returns a hash of dentry E's directory and name. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Returns the dentry for NAME in directory PARENT, or a null
+   pointer if it is not cached.  The caller must hold
+   dcache_lock. */
+static struct dentry *
+dcache_find (block_sector_t parent, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.parent = parent;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache_hash, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Looks up NAME in directory PARENT in the dentry cache.  If it is
+   cached, stores its inode sector, or 0 if the name does not
+   exist, in *SECTOR and returns true. */
+static bool
+dcache_lookup (block_sector_t parent, const char *name,
+               block_sector_t *sector)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = dcache_find (parent, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&dcache_lru, &d->lru_elem);
+      *sector = d->sector;
+    }
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Records in the dentry cache that NAME in directory PARENT is the
+   inode in SECTOR, or does not exist if SECTOR is 0.  The caller
+   must hold PARENT's directory lock, so that the cache changes in
+   the same order as the directory. */
+static void
+dcache_update (block_sector_t parent, const char *name,
+               block_sector_t sector)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+  lock_acquire (&dcache_lock);
+  d = dcache_find (parent, name);
+  if (d == NULL)
+    {
+      /* Reuse the least recently used dentry. */
+      d = list_entry (list_back (&dcache_lru), struct dentry, lru_elem);
+      if (d->valid)
+        hash_delete (&dcache_hash, &d->hash_elem);
+      d->valid = true;
+      d->parent = parent;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dcache_hash, &d->hash_elem);
+    }
+  d->sector = sector;
+  list_remove (&d->lru_elem);
+  list_push_front (&dcache_lru, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Drops every dentry for names in directory PARENT, which has
+   been removed, so that none survive to describe a directory that
+   later reuses its sector. */
+static void
+dcache_purge (block_sector_t parent)
+{
+  size_t i;
+
+  lock_acquire (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    {
+      struct dentry *d = &dentries[i];
+      if (d->valid && d->parent == parent)
+        {
+          hash_delete (&dcache_hash, &d->hash_elem);
+          d->valid = false;
+          list_remove (&d->lru_elem);
+          list_push_back (&dcache_lru, &d->lru_elem);
+        }
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Returns the inode sector of the file named NAME in DIR, or 0 if
+   there is none, consulting the dentry cache before the disk. */
+static block_sector_t
+cached_lookup (const struct dir *dir, const char *name)
+{
+  block_sector_t parent = inode_get_inumber (dir->inode);
+  block_sector_t sector;
+  struct dir_entry e;
+
+  if (!inode_is_dir (dir->inode))
+    return 0;
+  if (dcache_lookup (parent, name, &sector))
+    return sector;
+
+  lock_dir(dir->inode);
+  sector = lookup (dir, name, &e, NULL) ? e.inode_sector : 0;
+  dcache_update (parent, name, sector);
+  unlock_dir(dir->inode);
+  return sector;
+}
+
 /* A helper function that takes in path name, which can be full or relative path,
    and return the dir struct corresponding to the path */
 struct dir * open_dir_by_path(const char *path) {
   if (path == NULL){
     return NULL;
   }
-  struct dir *curr_dir;
+  struct inode *start;
   /* relative path */
   if (path[0] != '/' && thread_current()->cwd){
-    curr_dir = dir_reopen(thread_current()->cwd); 
+    start = dir_get_inode(thread_current()->cwd);
   }
   /* full path */ 
   else {
-    curr_dir = dir_open_root();
+    start = NULL;
   }
+  /* Walk the path by sector, opening a directory only when the
+     dentry cache misses, then open the last directory reached. */
+  block_sector_t sector = start != NULL ? inode_get_inumber(start)
+                                        : ROOT_DIR_SECTOR;
   char path_str[strlen(path) + 1];
   memcpy(path_str, path, strlen(path) + 1);
   char *token, *remaining, *ptr;
   token = strtok_r(path_str, "/", &ptr);
   remaining = strtok_r(NULL, "/", &ptr);
   while (remaining){
-    struct inode *curr_inode = NULL;
-    if (! dir_lookup(curr_dir, token, &curr_inode)){
-      /* fail to find the directory */
+    block_sector_t next;
+    if (!dcache_lookup(sector, token, &next)){
+      struct dir *curr_dir = dir_open(inode_open(sector));
+      if (curr_dir == NULL)
+        return NULL;
+      next = cached_lookup(curr_dir, token);
       dir_close(curr_dir);
+    }
+    if (next == 0){
+      /* fail to find the directory */
       return NULL;
     }
-    struct dir *next_dir = dir_open(curr_inode);
-    dir_close(curr_dir);
-    curr_dir = next_dir;
+    sector = next;
     token = remaining;
     remaining = strtok_r(NULL, "/", &ptr);
   }
-  return curr_dir;
+  return dir_open(inode_open(sector));
 }
 
 /* Extract file name from a path */
@@ -70,12 +324,13 @@ char *get_file_name_from_path(const char *path){
    return file;
 }
 
-/* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+/* Creates an empty directory in the given SECTOR.  Its index is
+   written by the first dir_add().  Returns true if successful,
+   false on failure. */
 bool
-dir_create (block_sector_t sector, size_t entry_cnt)
+dir_create (block_sector_t sector)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry), true);
+  return inode_create (sector, 0, true);
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -132,6 +387,340 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Reads SIZE bytes of block BLOCK of INODE into BUF.  Returns
+   true if the whole block was read. */
+static bool
+read_block (struct inode *inode, uint32_t block, void *buf, size_t size)
+{
+  return inode_read_at (inode, buf, size,
+                        (off_t) block * BLOCK_SECTOR_SIZE) == (off_t) size;
+}
+
+/* Writes SIZE bytes from BUF to block BLOCK of INODE.  Returns
+   true if the whole block was written. */
+static bool
+write_block (struct inode *inode, uint32_t block, const void *buf,
+             size_t size)
+{
+  return inode_write_at (inode, buf, size,
+                         (off_t) block * BLOCK_SECTOR_SIZE) == (off_t) size;
+}
+
+/* Returns the number of the block just past the end of INODE,
+   where a new block is appended. */
+static uint32_t
+next_block (struct inode *inode)
+{
+  return DIV_ROUND_UP (inode_length (inode), BLOCK_SECTOR_SIZE);
+}
+
+/* Returns the byte offset of entry SLOT of leaf block BLOCK. */
+static off_t
+entry_ofs (uint32_t block, int slot)
+{
+  return ((off_t) block * BLOCK_SECTOR_SIZE
+          + offsetof (struct dir_leaf, entries)
+          + slot * sizeof (struct dir_entry));
+}
+
+/* Returns the index of the entry in X whose range covers HASH. */
+static int
+index_find (const struct dir_index *x, uint32_t hash)
+{
+  int lo = 0, hi = x->count;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (x->entries[mid].hash <= hash)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo > 0 ? lo - 1 : 0;
+}
+
+/* Inserts an entry for HASH and BLOCK into X, which must have
+   room, at index POS. */
+static void
+index_insert (struct dir_index *x, int pos, uint32_t hash, uint32_t block)
+{
+  ASSERT (x->count < INDEX_ENTRIES);
+  memmove (x->entries + pos + 1, x->entries + pos,
+           (x->count - pos) * sizeof *x->entries);
+  x->entries[pos].hash = hash;
+  x->entries[pos].block = block;
+  x->count++;
+}
+
+/* Reads into P the path through INODE's index to the leaf for
+   names with the given HASH.  Returns false if the directory has
+   no index yet or it cannot be read. */
+static bool
+locate (struct inode *inode, uint32_t hash, struct dir_path *p)
+{
+  uint32_t block = 0;
+  int level;
+
+  for (level = 0; ; level++)
+    {
+      struct dir_index *x = &p->index[level];
+      if (!read_block (inode, block, x, sizeof *x)
+          || x->magic != DIR_INDEX_MAGIC || x->count == 0)
+        return false;
+      p->index_block[level] = block;
+      p->pos[level] = index_find (x, hash);
+      block = x->entries[p->pos[level]].block;
+      if (level == p->index[0].depth)
+        break;
+      if (level + 1 >= DIR_MAX_LEVELS)
+        return false;
+    }
+  p->levels = level + 1;
+  p->leaf_block = block;
+  return (read_block (inode, block, &p->leaf, sizeof p->leaf)
+          && p->leaf.magic == DIR_LEAF_MAGIC);
+}
+
+/* Writes an empty index to INODE, which must be empty: a root
+   with a single empty leaf below it.  The leaf goes first, so that
+   the directory stays without an index if writing the root fails.
+   Returns true if successful. */
+static bool
+create_index (struct inode *inode)
+{
+  struct dir_index *root;
+  struct dir_leaf *leaf;
+  bool success = false;
+
+  if (inode_length (inode) > 0)
+    return false;
+  root = calloc (1, sizeof *root);
+  leaf = calloc (1, sizeof *leaf);
+  if (root != NULL && leaf != NULL)
+    {
+      leaf->magic = DIR_LEAF_MAGIC;
+      root->magic = DIR_INDEX_MAGIC;
+      root->count = 1;
+      root->entries[0].hash = 0;
+      root->entries[0].block = 1;
+      success = (write_block (inode, 1, leaf, sizeof *leaf)
+                 && write_block (inode, 0, root, sizeof *root));
+    }
+  free (root);
+  free (leaf);
+  return success;
+}
+
+/* Returns true if INODE is a flat directory, one that holds
+   entries but has no index.  An empty directory is not flat: its
+   first dir_add() gives it an index. */
+static bool
+is_flat (struct inode *inode)
+{
+  uint32_t magic;
+
+  return (inode_length (inode) > 0
+          && (!read_block (inode, 0, &magic, sizeof magic)
+              || magic != DIR_INDEX_MAGIC));
+}
+
+/* Searches flat directory INODE for an entry in use for NAME, as
+   lookup() does. */
+static bool
+flat_lookup (struct inode *inode, const char *name,
+             struct dir_entry *ep, off_t *ofsp)
+{
+  struct dir_entry e;
+  off_t ofs;
+
+  for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    if (e.in_use && !strcmp (name, e.name))
+      {
+        if (ep != NULL)
+          *ep = e;
+        if (ofsp != NULL)
+          *ofsp = ofs;
+        return true;
+      }
+  return false;
+}
+
+/* Returns the byte offset of the first free entry in flat
+   directory INODE, or of its end if there is none. */
+static off_t
+flat_slot (struct inode *inode)
+{
+  struct dir_entry e;
+  off_t ofs;
+
+  for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    if (!e.in_use)
+      break;
+  return ofs;
+}
+
+/* Compares the hashes at A and B, for qsort(). */
+static int
+compare_hashes (const void *a_, const void *b_)
+{
+  const uint32_t *a = a_;
+  const uint32_t *b = b_;
+
+  return *a < *b ? -1 : *a > *b;
+}
+
+/* Chooses into *SPLIT a hash that divides the names in the full
+   LEAF, together with a new name whose hash is HASH, into two
+   groups as evenly as possible without separating names with
+   equal hashes.  Returns false if all of the hashes are equal. */
+static bool
+choose_split (const struct dir_leaf *leaf, uint32_t hash, uint32_t *split)
+{
+  uint32_t h[LEAF_ENTRIES + 1];
+  int n = 0, d, i;
+
+  for (i = 0; i < (int) LEAF_ENTRIES; i++)
+    h[n++] = hash_string (leaf->entries[i].name);
+  h[n++] = hash;
+  qsort (h, n, sizeof *h, compare_hashes);
+
+  for (d = 0; d < n; d++)
+    {
+      int k = n / 2 + d;
+      if (k < n && h[k] != h[k - 1])
+        {
+          *split = h[k];
+          return true;
+        }
+      k = n / 2 - d;
+      if (k >= 1 && h[k] != h[k - 1])
+        {
+          *split = h[k];
+          return true;
+        }
+    }
+  return false;
+}
+
+/* Makes room in the lowest index block on path P through INODE.
+   A full root is split into two new index blocks below it; a full
+   lower index block moves half of its entries to a new block.
+   New blocks are written before the blocks that point to them.
+   Returns false if the index cannot grow any further. */
+static bool
+split_index (struct inode *inode, struct dir_path *p)
+{
+  struct dir_index *root = &p->index[0];
+  struct dir_index *upper;
+  bool success = false;
+
+  upper = calloc (1, sizeof *upper);
+  if (upper == NULL)
+    return false;
+  upper->magic = DIR_INDEX_MAGIC;
+
+  if (p->levels == 1)
+    {
+      /* Move the root's entries into two new index blocks. */
+      struct dir_index *lower = &p->index[1];
+      int half = root->count / 2;
+      uint32_t lower_block = next_block (inode);
+      uint32_t upper_block = lower_block + 1;
+
+      memset (lower, 0, sizeof *lower);
+      lower->magic = DIR_INDEX_MAGIC;
+      lower->count = half;
+      memcpy (lower->entries, root->entries, half * sizeof *root->entries);
+      upper->count = root->count - half;
+      memcpy (upper->entries, root->entries + half,
+              upper->count * sizeof *root->entries);
+      if (write_block (inode, lower_block, lower, sizeof *lower)
+          && write_block (inode, upper_block, upper, sizeof *upper))
+        {
+          root->depth = 1;
+          root->count = 0;
+          index_insert (root, 0, 0, lower_block);
+          index_insert (root, 1, upper->entries[0].hash, upper_block);
+          success = write_block (inode, 0, root, sizeof *root);
+        }
+    }
+  else if (root->count < INDEX_ENTRIES)
+    {
+      /* Move the upper half of the lower block to a new one. */
+      struct dir_index *lower = &p->index[1];
+      int half = lower->count / 2;
+      uint32_t upper_block = next_block (inode);
+
+      upper->count = lower->count - half;
+      memcpy (upper->entries, lower->entries + half,
+              upper->count * sizeof *lower->entries);
+      if (write_block (inode, upper_block, upper, sizeof *upper))
+        {
+          lower->count = half;
+          index_insert (root, p->pos[0] + 1, upper->entries[0].hash,
+                        upper_block);
+          success = (write_block (inode, p->index_block[1], lower,
+                                  sizeof *lower)
+                     && write_block (inode, 0, root, sizeof *root));
+        }
+    }
+  free (upper);
+  return success;
+}
+
+/* Splits the full leaf on path P through INODE to make room for a
+   name with the given HASH, moving the names that hash at or
+   above the split point into a new leaf, or, if the index has no
+   room for the new leaf, splits the index instead.  The caller
+   should look the leaf up again afterward.  Returns false if the
+   directory cannot grow. */
+static bool
+split_leaf (struct inode *inode, struct dir_path *p, uint32_t hash)
+{
+  struct dir_index *x = &p->index[p->levels - 1];
+  struct dir_leaf *upper;
+  uint32_t split, upper_block;
+  int i, n;
+  bool success = false;
+
+  if (x->count >= INDEX_ENTRIES)
+    return split_index (inode, p);
+  if (!choose_split (&p->leaf, hash, &split))
+    return false;
+
+  upper = calloc (1, sizeof *upper);
+  if (upper == NULL)
+    return false;
+  upper->magic = DIR_LEAF_MAGIC;
+  upper_block = next_block (inode);
+
+  /* Append the new leaf empty first, so that a failure cannot
+     leave the moved names in the directory twice. */
+  if (write_block (inode, upper_block, upper, sizeof *upper))
+    {
+      for (i = n = 0; i < (int) LEAF_ENTRIES; i++)
+        {
+          struct dir_entry *e = &p->leaf.entries[i];
+          if (e->in_use && hash_string (e->name) >= split)
+            {
+              upper->entries[n++] = *e;
+              e->in_use = false;
+            }
+        }
+      index_insert (x, p->pos[p->levels - 1] + 1, split, upper_block);
+      success = (write_block (inode, upper_block, upper, sizeof *upper)
+                 && write_block (inode, p->leaf_block, &p->leaf,
+                                 sizeof p->leaf)
+                 && write_block (inode, p->index_block[p->levels - 1], x,
+                                 sizeof *x));
+    }
+  free (upper);
+  return success;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -141,23 +730,85 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp)
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_path *p;
+  bool found = false;
+  int i;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (e.in_use && !strcmp (name, e.name))
+  if (is_flat (dir->inode))
+    return flat_lookup (dir->inode, name, ep, ofsp);
+
+  p = malloc (sizeof *p);
+  if (p == NULL)
+    return false;
+  if (locate (dir->inode, hash_string (name), p))
+    for (i = 0; i < (int) LEAF_ENTRIES; i++)
       {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
+        struct dir_entry *e = &p->leaf.entries[i];
+        if (e->in_use && !strcmp (name, e->name))
+          {
+            if (ep != NULL)
+              *ep = *e;
+            if (ofsp != NULL)
+              *ofsp = entry_ofs (p->leaf_block, i);
+            found = true;
+            break;
+          }
       }
-  return false;
+  free (p);
+  return found;
+}
+
+/* Reads into *EP the first entry in use at or after slot *POS of
+   the leaves of INODE, in file order, skipping index blocks, and
+   advances *POS past it.  In a flat directory, *POS counts
+   entries from the start instead.  Returns false if there is
+   none. */
+static bool
+next_entry (struct inode *inode, off_t *pos, struct dir_entry *ep)
+{
+  struct dir_leaf *leaf;
+  bool found = false;
+
+  if (is_flat (inode))
+    {
+      while (inode_read_at (inode, ep, sizeof *ep, *pos * sizeof *ep)
+             == sizeof *ep)
+        {
+          (*pos)++;
+          if (ep->in_use)
+            return true;
+        }
+      return false;
+    }
+
+  leaf = malloc (sizeof *leaf);
+  if (leaf == NULL)
+    return false;
+  while (!found
+         && (off_t) (*pos / LEAF_ENTRIES) * BLOCK_SECTOR_SIZE
+            < inode_length (inode))
+    {
+      uint32_t block = *pos / LEAF_ENTRIES;
+      if (!read_block (inode, block, leaf, sizeof *leaf)
+          || leaf->magic != DIR_LEAF_MAGIC)
+        {
+          *pos = (block + 1) * LEAF_ENTRIES;
+          continue;
+        }
+      for (; *pos < (off_t) ((block + 1) * LEAF_ENTRIES); (*pos)++)
+        if (leaf->entries[*pos % LEAF_ENTRIES].in_use)
+          {
+            *ep = leaf->entries[*pos % LEAF_ENTRIES];
+            (*pos)++;
+            found = true;
+            break;
+          }
+    }
+  free (leaf);
+  return found;
 }
 
 /* Searches DIR for a file with the given NAME
@@ -168,19 +819,13 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode)
 {
-  struct dir_entry e;
+  block_sector_t sector;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  lock_dir(dir->inode);
-
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
-
-  unlock_dir(dir->inode);
+  sector = cached_lookup (dir, name);
+  *inode = sector != 0 ? inode_open (sector) : NULL;
 
   return *inode != NULL;
 }
@@ -195,43 +840,66 @@ bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is_dir)
 {
   struct dir_entry e;
-  off_t ofs;
+  struct dir_path *p = NULL;
+  uint32_t hash;
   bool success = false;
+  off_t ofs;
+  int slot;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  lock_dir(dir->inode);
-
   /* Check NAME for validity. */
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  lock_dir(dir->inode);
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (!e.in_use)
-      break;
+  if (is_flat (dir->inode))
+    ofs = flat_slot (dir->inode);
+  else
+    {
+      p = malloc (sizeof *p);
+      if (p == NULL)
+        goto done;
+      hash = hash_string (name);
+      if (!locate (dir->inode, hash, p)
+          && !(create_index (dir->inode) && locate (dir->inode, hash, p)))
+        goto done;
+
+      /* Find a free slot in the leaf for NAME, splitting it until
+         one turns up. */
+      for (;;)
+        {
+          for (slot = 0; slot < (int) LEAF_ENTRIES; slot++)
+            if (!p->leaf.entries[slot].in_use)
+              break;
+          if (slot < (int) LEAF_ENTRIES)
+            break;
+          if (!split_leaf (dir->inode, p, hash)
+              || !locate (dir->inode, hash, p))
+            goto done;
+        }
+      ofs = entry_ofs (p->leaf_block, slot);
+    }
 
   /* Write slot. */
+  memset (&e, 0, sizeof e);
   e.in_use = true;
   e.is_dir = is_dir;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (success)
+    dcache_update (inode_get_inumber (dir->inode), name, inode_sector);
 
  done:
   unlock_dir(dir->inode);
+  free (p);
   return success;
 }
 
@@ -265,11 +933,17 @@ dir_remove (struct dir *dir, const char *name)
       goto done;
   }
 
-  /* Erase directory entry. */
+  /* Erase directory entry.  Leaves are never merged, so the slot
+     is simply reused by a later dir_add() of a name in its
+     range. */
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
     goto done;
 
+  dcache_update (inode_get_inumber (dir->inode), name, 0);
+  if (inode_is_dir (inode))
+    dcache_purge (e.inode_sector);
+
   /* Remove inode. */
   inode_remove (inode);
   success = true;
@@ -289,11 +963,10 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
   lock_dir(dir->inode);
   struct dir_entry e;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e)
+  while (next_entry (dir->inode, &dir->pos, &e))
     {
-      dir->pos += sizeof e;
       /* . and .. should not be returned by readdir */
-      if (e.in_use && strcmp(e.name, ".")!=0 && strcmp(e.name, "..")!=0)
+      if (strcmp(e.name, ".")!=0 && strcmp(e.name, "..")!=0)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
           unlock_dir(dir->inode);
@@ -309,9 +982,9 @@ bool
 dir_is_empty(struct inode *inode)
 {
   struct dir_entry e;
-  size_t ofs;
-  for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e; ofs += sizeof e){
-    if (e.in_use && strcmp (".", e.name)!=0 && strcmp("..", e.name)!=0){
+  off_t pos = 0;
+  while (next_entry (inode, &pos, &e)){
+    if (strcmp (".", e.name)!=0 && strcmp("..", e.name)!=0){
       return false;
     }
   }
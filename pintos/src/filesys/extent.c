@@ -0,0 +1,331 @@
+#include "filesys/extent.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/free-map.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+
+/* Identifies an extent tree node. */
+#define EXTENT_MAGIC 0xf30a
+
+/* Limit on the height of a tree, far above what a disk of
+   2**32 sectors needs. */
+#define EXTENT_MAX_DEPTH 8
+
+/* Number of extents in a one-sector node. */
+#define NODE_ENTRIES ((BLOCK_SECTOR_SIZE - sizeof (struct extent_header)) \
+                      / sizeof (struct extent))
+
+/* A node of an extent tree below the root, one sector long. */
+struct extent_node
+  {
+    struct extent_header header;
+    struct extent entries[NODE_ENTRIES];
+  };
+
+/* Returns the extents that follow header H. */
+static struct extent *
+entries_of (const struct extent_header *h)
+{
+  return (struct extent *) (h + 1);
+}
+
+/* Returns the index of the last extent in H that starts at or
+   before LOGICAL, or -1 if there is none. */
+static int
+find (const struct extent_header *h, uint32_t logical)
+{
+  const struct extent *e = entries_of (h);
+  int lo = 0, hi = h->entries;
+
+  ASSERT (h->magic == EXTENT_MAGIC);
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (e[mid].logical <= logical)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo - 1;
+}
+
+/* Initializes ROOT as an empty tree. */
+void
+extent_init (struct extent_root *root)
+{
+  memset (root, 0, sizeof *root);
+  root->header.magic = EXTENT_MAGIC;
+  root->header.max = EXTENT_ROOT_ENTRIES;
+}
+
+/* Returns the disk sector that holds file sector LOGICAL in the
+   tree at ROOT, or 0 if LOGICAL is not mapped.  If RUN is
+   non-null, stores in it the number of sectors from LOGICAL on
+   that are mapped contiguously on disk (at least 1). */
+block_sector_t
+extent_lookup (const struct extent_root *root, uint32_t logical,
+               uint32_t *run)
+{
+  const struct extent_header *h = &root->header;
+  const void *pinned = NULL;
+  block_sector_t sector = 0;
+  uint32_t length = 1;
+
+  for (;;)
+    {
+      const struct extent *e = entries_of (h);
+      int i = find (h, logical);
+
+      if (h->depth == 0)
+        {
+          if (i >= 0 && logical - e[i].logical < e[i].count)
+            {
+              sector = e[i].start + (logical - e[i].logical);
+              length = e[i].count - (logical - e[i].logical);
+            }
+          break;
+        }
+      if (i < 0)
+        break;
+
+      /* Descend, keeping only one node pinned at a time. */
+      block_sector_t child = e[i].start;
+      if (pinned != NULL)
+        cache_put (pinned, false);
+      pinned = h = cache_get (child, CACHE_READ);
+    }
+  if (pinned != NULL)
+    cache_put (pinned, false);
+
+  if (run != NULL)
+    *run = length;
+  return sector;
+}
+
+/* Inserts X into H at index POS, which must have room. */
+static void
+insert_at (struct extent_header *h, int pos, const struct extent *x)
+{
+  struct extent *e = entries_of (h);
+
+  ASSERT (h->entries < h->max);
+  memmove (e + pos + 1, e + pos, (h->entries - pos) * sizeof *e);
+  e[pos] = *x;
+  h->entries++;
+}
+
+/* Inserts X into the full node H at index POS by moving its upper
+   entries into SIBLING, a new node to be written at SECTOR.
+   Appends, the common case, leave H full and start SIBLING with X
+   alone, so that sequentially written files pack their nodes.
+   Returns the index entry for SIBLING. */
+static struct extent
+split_node (struct extent_header *h, int pos, const struct extent *x,
+            struct extent_node *sibling, block_sector_t sector)
+{
+  struct extent *e = entries_of (h);
+  int keep = pos == h->entries ? h->entries : h->entries / 2;
+  struct extent index;
+
+  memset (sibling, 0, sizeof *sibling);
+  sibling->header.magic = EXTENT_MAGIC;
+  sibling->header.entries = h->entries - keep;
+  sibling->header.max = NODE_ENTRIES;
+  sibling->header.depth = h->depth;
+  memcpy (sibling->entries, e + keep, (h->entries - keep) * sizeof *e);
+  h->entries = keep;
+
+  if (pos < keep)
+    insert_at (h, pos, x);
+  else
+    insert_at (&sibling->header, pos - keep, x);
+  journal_write (sector, sibling);
+
+  index.logical = sibling->entries[0].logical;
+  index.start = sector;
+  index.count = 0;
+  return index;
+}
+
+/* Moves the entries of ROOT into a new node below it, allocated
+   near GOAL, so that the root has room for another entry.
+   Returns false if out of disk space or memory. */
+static bool
+grow_root (struct extent_root *root, block_sector_t goal)
+{
+  struct extent_node *node;
+  block_sector_t sector;
+
+  if (root->header.depth + 1 >= EXTENT_MAX_DEPTH)
+    return false;
+  node = calloc (1, sizeof *node);
+  if (node == NULL)
+    return false;
+  if (!free_map_allocate_near (1, goal, &sector))
+    {
+      free (node);
+      return false;
+    }
+  node->header = root->header;
+  node->header.max = NODE_ENTRIES;
+  memcpy (node->entries, root->entries,
+          root->header.entries * sizeof *root->entries);
+  journal_write (sector, node);
+
+  root->header.depth++;
+  root->header.entries = 1;
+  root->entries[0].logical = node->entries[0].logical;
+  root->entries[0].start = sector;
+  root->entries[0].count = 0;
+  free (node);
+  return true;
+}
+
+/* Maps the COUNT file sectors starting at LOGICAL, which must not
+   be mapped yet, to the disk sectors starting at START.  The
+   caller must write the inode holding ROOT back afterward.  New
+   tree nodes are allocated near START.  Returns false if out of disk space or memory for new tree
+   nodes, in which case nothing was mapped.
+
+   The path from the root to the leaf is read into memory first,
+   and a sector reserved for every node on it that might have to
+   be split, so that once the tree starts changing the insertion
+   cannot fail halfway. */
+bool
+extent_insert (struct extent_root *root, uint32_t logical,
+               block_sector_t start, uint32_t count)
+{
+  struct extent_header *path[EXTENT_MAX_DEPTH];
+  block_sector_t path_sector[EXTENT_MAX_DEPTH];
+  int path_idx[EXTENT_MAX_DEPTH];
+  block_sector_t spares[EXTENT_MAX_DEPTH];
+  struct extent_node *nodes;
+  struct extent x = { logical, start, count };
+  struct extent *e;
+  int depth, level, needed, got, i;
+
+  ASSERT (count > 0);
+  if (root->header.entries == root->header.max)
+    {
+      struct extent *last = &root->entries[root->header.entries - 1];
+      if (root->header.depth == 0
+          && last->logical + last->count == logical
+          && last->start + last->count == start)
+        {
+          last->count += count;
+          return true;
+        }
+      if (!grow_root (root, start))
+        return false;
+    }
+
+  /* One buffer per node below the root, plus one for a sibling. */
+  depth = root->header.depth;
+  ASSERT (depth < EXTENT_MAX_DEPTH);
+  nodes = malloc ((depth + 1) * sizeof *nodes);
+  if (nodes == NULL)
+    return false;
+
+  /* Read in the path, sending X to the child that covers it, or
+     the first child if it precedes them all. */
+  path[0] = &root->header;
+  for (level = 0; level < depth; level++)
+    {
+      e = entries_of (path[level]);
+      i = find (path[level], logical);
+      if (i < 0)
+        {
+          i = 0;
+          e[0].logical = logical;
+        }
+      path_idx[level] = i;
+      path_sector[level + 1] = e[i].start;
+      cache_read (e[i].start, &nodes[level]);
+      path[level + 1] = &nodes[level].header;
+    }
+
+  /* Extend the previous extent if X continues it both in the file
+     and on disk. */
+  e = entries_of (path[depth]);
+  i = find (path[depth], logical);
+  if (i >= 0 && e[i].logical + e[i].count == logical
+      && e[i].start + e[i].count == start)
+    {
+      e[i].count += count;
+      goto done;
+    }
+  path_idx[depth] = i + 1;
+
+  /* Reserve a sector for each full node that would split. */
+  needed = 0;
+  for (level = depth; level > 0; level--)
+    if (path[level]->entries == path[level]->max)
+      needed++;
+    else
+      break;
+  for (got = 0; got < needed; got++)
+    if (!free_map_allocate_near (1, start, &spares[got]))
+      {
+        while (got-- > 0)
+          free_map_release (spares[got], 1);
+        free (nodes);
+        return false;
+      }
+
+  /* Insert at the leaf, passing splits up the path. */
+  for (level = depth; ; level--)
+    {
+      struct extent_header *h = path[level];
+      if (h->entries < h->max)
+        {
+          insert_at (h, path_idx[level], &x);
+          break;
+        }
+      ASSERT (level > 0 && needed > 0);
+      x = split_node (h, path_idx[level], &x, &nodes[depth],
+                      spares[--needed]);
+      path_idx[level - 1]++;
+    }
+  ASSERT (needed == 0);
+
+ done:
+  for (level = 1; level <= depth; level++)
+    journal_write (path_sector[level], path[level]);
+  free (nodes);
+  return true;
+}
+
+/* Releases the sectors mapped by the extents in H, and the nodes
+   below it. */
+static void
+release_entries (const struct extent_header *h)
+{
+  const struct extent *e = entries_of (h);
+  int i;
+
+  for (i = 0; i < h->entries; i++)
+    if (h->depth == 0)
+      free_map_release (e[i].start, e[i].count);
+    else
+      {
+        struct extent_node *child = malloc (sizeof *child);
+        if (child != NULL)
+          {
+            cache_read (e[i].start, child);
+            release_entries (&child->header);
+            free (child);
+          }
+        free_map_release (e[i].start, 1);
+      }
+}
+
+/* Releases every sector mapped by ROOT, and the tree itself, and
+   leaves ROOT empty. */
+void
+extent_release (struct extent_root *root)
+{
+  release_entries (&root->header);
+  extent_init (root);
+}
@@ -0,0 +1,47 @@
+#ifndef FILESYS_EXTENT_H
+#define FILESYS_EXTENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "devices/block.h"
+
+/* A run of COUNT contiguous sectors starting at disk sector
+   START, holding the file's sectors from LOGICAL onward.  In an
+   interior node of the tree, START is instead the child node
+   and LOGICAL the first file sector it maps; COUNT is unused. */
+struct extent
+  {
+    uint32_t logical;                   /* First file sector mapped. */
+    block_sector_t start;               /* First disk sector, or child node. */
+    uint32_t count;                     /* Number of sectors. */
+  };
+
+/* Starts every node of an extent tree. */
+struct extent_header
+  {
+    uint16_t magic;                     /* EXTENT_MAGIC. */
+    uint16_t entries;                   /* Extents in use. */
+    uint16_t max;                       /* Extents that fit in the node. */
+    uint16_t depth;                     /* 0 for a leaf. */
+  };
+
+/* Number of extents in the root of the tree. */
+#define EXTENT_ROOT_ENTRIES 41
+
+/* Root of an extent tree, kept in the on-disk inode.  Small
+   files fit entirely in the root; larger ones push the extents
+   down into one-sector nodes below it. */
+struct extent_root
+  {
+    struct extent_header header;
+    struct extent entries[EXTENT_ROOT_ENTRIES];
+  };
+
+void extent_init (struct extent_root *);
+block_sector_t extent_lookup (const struct extent_root *, uint32_t logical,
+                              uint32_t *run);
+bool extent_insert (struct extent_root *, uint32_t logical,
+                    block_sector_t start, uint32_t count);
+void extent_release (struct extent_root *);
+
+#endif /* filesys/extent.h */
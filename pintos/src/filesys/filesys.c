@@ -1,5 +1,6 @@
 #include "filesys/filesys.h"
 #include <debug.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include "filesys/file.h"
@@ -7,13 +8,30 @@
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "filesys/cache.h"
+#include "filesys/journal.h"
 #include "threads/thread.h"
 #include "threads/malloc.h"
 
+/* Identifies a superblock. */
+#define SUPER_MAGIC 0x52505553
+
+/* On-disk superblock, in SUPER_SECTOR.
+   Must be exactly BLOCK_SECTOR_SIZE=512 bytes long. */
+struct super_block
+  {
+    uint32_t magic;                     /* SUPER_MAGIC. */
+    uint32_t version;                   /* Format version. */
+    uint32_t unused[126];               /* Not used. */
+  };
+
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+/* True if the file system must not be changed. */
+static bool read_only;
+
 static void do_format (void);
+static void check_version (void);
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
@@ -27,11 +45,15 @@ filesys_init (bool format)
 
   cache_init();
   inode_init ();
+  dir_init ();
   free_map_init ();
 
   if (format)
     do_format ();
 
+  check_version ();
+  if (!read_only)
+    journal_open ();
   free_map_open ();
   
 }
@@ -41,10 +63,49 @@ filesys_init (bool format)
 void
 filesys_done (void)
 {
+  inode_flush_all ();
+  journal_close ();
   free_map_close ();
   cache_close();
 }
 
+/* Reads the superblock and decides how to mount the file system
+   from its format version, as described at FILESYS_VERSION. */
+static void
+check_version (void)
+{
+  struct super_block sb;
+
+  cache_read (SUPER_SECTOR, &sb);
+  if (sb.magic != SUPER_MAGIC)
+    {
+      printf ("filesys: no superblock, mounting read-only\n");
+      read_only = true;
+    }
+  else if (sb.version != FILESYS_VERSION)
+    PANIC ("file system has format version %"PRIu32", "
+           "expected %d; reformat with -f", sb.version, FILESYS_VERSION);
+  else
+    read_only = false;
+}
+
+/* Returns true if the file system was mounted read-only, so that
+   nothing on it may be changed. */
+bool
+filesys_read_only (void)
+{
+  return read_only;
+}
+
+/* Writes all file data to disk and commits the journal, so that
+   everything done so far survives a crash. */
+void
+filesys_sync (void)
+{
+  inode_flush_all ();
+  journal_commit ();
+}
+
 /* Creates a file named NAME with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
@@ -52,21 +113,24 @@ filesys_done (void)
 bool
 filesys_create (const char *name, off_t initial_size, bool is_dir)
 {
-  if (name == NULL){
+  if (name == NULL || read_only){
     return NULL;
   }
+  journal_begin ();
   block_sector_t inode_sector = 0;
   char *file_name = get_file_name_from_path(name);
   struct dir *dir = open_dir_by_path(name);
   bool success = (dir != NULL
                   && file_name != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate_near (1, inode_get_inumber (dir_get_inode (dir)),
+                                             &inode_sector)
                   && inode_create (inode_sector, initial_size, is_dir)
                   && dir_add (dir, file_name, inode_sector, is_dir));
   if (!success && inode_sector != 0)
     free_map_release (inode_sector, 1);
   dir_close (dir);
   free(file_name);
+  journal_end ();
   return success;
 }
 
@@ -132,11 +196,15 @@ filesys_open_inode (const char *name)
 bool
 filesys_remove (const char *name)
 {
+  if (read_only)
+    return false;
+  journal_begin ();
   char *file_name = get_file_name_from_path(name);
   struct dir *dir = open_dir_by_path(name);
   bool success = dir != NULL && dir_remove (dir,file_name);
   dir_close (dir);
   free(file_name);
+  journal_end ();
   return success;
 }
 
@@ -183,13 +251,16 @@ filesys_mkdir (const char *name)
   block_sector_t inode_sector = 0;
   int initial_size = 0;
   bool is_dir = true;
+  if (read_only)
+    return false;
+  journal_begin ();
   char *file_name = get_file_name_from_path(name);
   struct dir *dir = open_dir_by_path(name);
   bool success = (dir != NULL
                   && file_name != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  // start with 0 entries in dir
-                  && dir_create (inode_sector, 0)
+                  && free_map_allocate_near (1, inode_get_inumber (dir_get_inode (dir)),
+                                             &inode_sector)
+                  && dir_create (inode_sector)
                   && dir_add (dir, file_name, inode_sector, is_dir));
   if (!success){
     if (inode_sector != 0){
@@ -197,6 +268,7 @@ filesys_mkdir (const char *name)
     }
     dir_close (dir);
     free(file_name);
+    journal_end ();
     return false;
   }
   /*end of borrowing */
@@ -209,6 +281,7 @@ filesys_mkdir (const char *name)
   }
   dir_close(dir);
   free(file_name);
+  journal_end ();
   return success;
 }
 
@@ -216,9 +289,16 @@ filesys_mkdir (const char *name)
 static void
 do_format (void)
 {
+  struct super_block sb;
+
   printf ("Formatting file system...");
+  memset (&sb, 0, sizeof sb);
+  sb.magic = SUPER_MAGIC;
+  sb.version = FILESYS_VERSION;
+  cache_write (SUPER_SECTOR, &sb);
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 0))
+  journal_create ();
+  if (!dir_create (ROOT_DIR_SECTOR))
     PANIC ("root directory creation failed");
   
   struct dir *dir = dir_open_root();
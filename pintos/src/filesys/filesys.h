@@ -7,12 +7,30 @@
 /* Sectors of system file inodes. */
 #define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+#define SUPER_SECTOR 2          /* Superblock sector. */
+
+/* On-disk format version that do_format() writes to the
+   superblock.  Mounting accepts:
+
+   0: No superblock, from before there was one.  Inodes map each
+      sector through pointers and directories are flat arrays of
+      entries; both layouts are still read.  There is no journal,
+      and starting one would overwrite live sectors, so the disk
+      is mounted read-only.
+   1: The superblock, followed by the journal.  New inodes map
+      their data with extents and new directories have a hash
+      index.
+
+   Disks of any other version are refused. */
+#define FILESYS_VERSION 1
 
 /* Block device that contains the file system. */
 struct block *fs_device;
 
 void filesys_init (bool format);
 void filesys_done (void);
+void filesys_sync (void);
+bool filesys_read_only (void);
 bool filesys_create (const char *name, off_t initial_size, bool is_dir);
 struct file *filesys_open (const char *name);
 struct inode *filesys_open_inode (const char *name);
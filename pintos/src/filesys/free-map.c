@@ -1,12 +1,74 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Bits of the free map stored in one sector of its file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Sectors per block group.  Allocation searches a group at a
+   time, starting from the group of the caller's goal sector, and
+   skips groups whose free count shows the request cannot fit. */
+#define GROUP_SECTORS 1024
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *dirty;         /* Free map file sectors to write. */
+static struct bitmap *released;      /* Sectors to free at the next sync. */
+static size_t released_cnt;          /* Number of bits set in RELEASED. */
+static size_t *group_free;           /* Free sectors in each group. */
+static size_t group_cnt;             /* Number of block groups. */
+static size_t free_cnt;              /* Free sectors on the disk. */
+static size_t reserved;              /* Free sectors set aside. */
+static struct lock free_map_lock;    /* Protects the bitmaps and counts. */
+
+/* Recounts the free sectors in each block group. */
+static void
+count_groups (void)
+{
+  size_t g;
+
+  free_cnt = 0;
+  for (g = 0; g < group_cnt; g++)
+    {
+      size_t start = g * GROUP_SECTORS;
+      size_t end = start + GROUP_SECTORS;
+      if (end > bitmap_size (free_map))
+        end = bitmap_size (free_map);
+      group_free[g] = bitmap_count (free_map, start, end - start, false);
+      free_cnt += group_free[g];
+    }
+}
+
+/* Subtracts CNT sectors starting at SECTOR from the free counts
+   of their groups if ALLOCATED, adds them back otherwise. */
+static void
+update_groups (block_sector_t sector, size_t cnt, bool allocated)
+{
+  if (allocated)
+    free_cnt -= cnt;
+  else
+    free_cnt += cnt;
+  while (cnt > 0)
+    {
+      size_t g = sector / GROUP_SECTORS;
+      size_t n = (g + 1) * GROUP_SECTORS - sector;
+      if (n > cnt)
+        n = cnt;
+      if (allocated)
+        group_free[g] -= n;
+      else
+        group_free[g] += n;
+      sector += n;
+      cnt -= n;
+    }
+}
 
 /* Initializes the free map. */
 void
@@ -15,38 +77,239 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                       BITS_PER_SECTOR));
+  if (dirty == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  released = bitmap_create (bitmap_size (free_map));
+  if (released == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  released_cnt = 0;
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (group_free == NULL)
+    PANIC ("block group allocation failed");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_mark (free_map, SUPER_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, journal_size (), true);
+  count_groups ();
+}
+
+/* Notes that the CNT bits starting at SECTOR changed, so that
+   the free map file sectors holding them must be written. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  bitmap_set_multiple (dirty, first, last - first + 1, true);
+}
+
+/* Returns the first run of CNT free sectors that starts at or
+   after START and before END, or BITMAP_ERROR if there is none. */
+static size_t
+scan_range (size_t start, size_t end, size_t cnt)
+{
+  size_t limit = end + cnt - 1;
+  size_t sector, run = 0;
+
+  if (limit > bitmap_size (free_map))
+    limit = bitmap_size (free_map);
+  for (sector = start; sector < limit; sector++)
+    if (bitmap_test (free_map, sector))
+      run = 0;
+    else if (++run == cnt)
+      return sector - (cnt - 1);
+  return BITMAP_ERROR;
+}
+
+/* Returns the first run of CNT free sectors at or after GOAL,
+   wrapping around to the start of the disk, or BITMAP_ERROR if
+   there is none.  Groups with fewer than CNT free sectors are
+   passed over, unless the run could only fit across groups. */
+static size_t
+scan_groups (block_sector_t goal, size_t cnt)
+{
+  size_t first = goal / GROUP_SECTORS;
+  size_t i;
+
+  if (cnt == 0 || cnt > bitmap_size (free_map))
+    return BITMAP_ERROR;
+  for (i = 0; i <= group_cnt; i++)
+    {
+      size_t g = (first + i) % group_cnt;
+      size_t start = g * GROUP_SECTORS;
+      size_t end = start + GROUP_SECTORS;
+      size_t sector;
+
+      /* The goal's group is searched twice: from the goal on at
+         first, and from its start on last. */
+      if (i == 0)
+        start = goal;
+      else if (i == group_cnt)
+        end = goal;
+      if (cnt <= GROUP_SECTORS && group_free[g] < cnt)
+        continue;
+      sector = scan_range (start, end, cnt);
+      if (sector != BITMAP_ERROR)
+        return sector;
+    }
+  return cnt > 1 ? scan_range (0, bitmap_size (free_map), cnt)
+                 : BITMAP_ERROR;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available.
+   The change reaches the free map file at the next
+   free_map_sync(). */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (cnt, 0, sectorp);
+}
+
+/* Like free_map_allocate(), but prefers the first run at or after
+   GOAL, so that related sectors stay close together.  Sectors set
+   aside by free_map_reserve() are not handed out. */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t goal,
+                        block_sector_t *sectorp)
+{
+  block_sector_t sector;
+
+  if (goal >= bitmap_size (free_map))
+    goal = 0;
+  lock_acquire (&free_map_lock);
+  sector = free_cnt - reserved >= cnt ? scan_groups (goal, cnt)
+                                      : BITMAP_ERROR;
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false);
-      sector = BITMAP_ERROR;
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      update_groups (sector, cnt, true);
+      mark_dirty (sector, cnt);
     }
+  lock_release (&free_map_lock);
+
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Makes CNT sectors starting at SECTOR available for use, as of
+   the next free_map_sync().  Until then they are not handed out
+   again: the journal commits the release with that sync, and
+   before the commit the sectors may still be in use on disk. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  ASSERT (bitmap_none (released, sector, cnt));
+  bitmap_set_multiple (released, sector, cnt, true);
+  released_cnt += cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Returns true if free_map_sync() is due, because sectors waiting
+   to be released outnumber the available ones or the disk is
+   getting full. */
+bool
+free_map_sync_wanted (void)
+{
+  bool wanted;
+
+  lock_acquire (&free_map_lock);
+  wanted = (released_cnt > 0
+            && free_cnt - reserved < released_cnt
+                                     + bitmap_size (free_map) / 8);
+  lock_release (&free_map_lock);
+  return wanted;
+}
+
+/* Frees the sectors released since the last call.  The caller
+   must hold free_map_lock. */
+static void
+apply_releases (void)
+{
+  size_t start, end;
+
+  for (start = 0; released_cnt > 0; start = end)
+    {
+      start = bitmap_scan (released, start, 1, true);
+      ASSERT (start != BITMAP_ERROR);
+      end = bitmap_scan (released, start, 1, false);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (released);
+      bitmap_set_multiple (free_map, start, end - start, false);
+      bitmap_set_multiple (released, start, end - start, false);
+      update_groups (start, end - start, false);
+      mark_dirty (start, end - start);
+      released_cnt -= end - start;
+    }
+}
+
+/* Sets aside CNT free sectors, without choosing which, so that a
+   later allocation of that many is sure to succeed.  Returns
+   false if fewer than CNT sectors are free and not already set
+   aside. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = free_cnt - reserved >= cnt;
+  if (success)
+    reserved += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Returns CNT sectors set aside by free_map_reserve(), which
+   makes them available to free_map_allocate() again. */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved >= cnt);
+  reserved -= cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Frees the sectors released since the last call, then writes
+   the sectors of the free map file that changed, merging adjacent
+   ones into a single write. */
+void
+free_map_sync (void)
+{
+  size_t first, last;
+
+  lock_acquire (&free_map_lock);
+  apply_releases ();
+  if (free_map_file != NULL)
+    for (first = 0; first < bitmap_size (dirty); first = last)
+      {
+        first = bitmap_scan (dirty, first, 1, true);
+        if (first == BITMAP_ERROR)
+          break;
+        last = bitmap_scan (dirty, first, 1, false);
+        if (last == BITMAP_ERROR)
+          last = bitmap_size (dirty);
+
+        size_t start = first * BITS_PER_SECTOR;
+        size_t end = last * BITS_PER_SECTOR;
+        if (end > bitmap_size (free_map))
+          end = bitmap_size (free_map);
+        if (!bitmap_write_part (free_map, free_map_file, start, end - start))
+          PANIC ("can't write free map");
+        bitmap_set_multiple (dirty, first, last - first, false);
+      }
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +321,16 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  count_groups ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void)
 {
+  free_map_sync ();
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -82,4 +348,5 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty, false);
 }
@@ -1,5 +1,5 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
@@ -9,20 +9,59 @@
 #include "threads/synch.h"
 #include <stdio.h>
 #include "filesys/cache.h"
+#include "filesys/extent.h"
+#include "filesys/journal.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Read-ahead window bounds, in sectors. */
+#define READ_AHEAD_MIN 2
+#define READ_AHEAD_MAX 32
+
+/* Sectors appended to a file that may be kept in memory before
+   they are given disk sectors, and sectors set aside for the
+   indirect blocks or extent tree nodes that this may take. */
+#define DELAY_SECTORS 16
+#define DELAY_SLACK 4
+
+/* Bytes written per journal operation by inode_write_at(), few
+   enough that one chunk's metadata fits an operation's share of
+   the journal. */
+#define WRITE_CHUNK 8192
+
+/* Sector pointers in an indexed inode, and in one sector. */
+#define DIRECT_CNT 123
+#define PTRS_PER_SECTOR (BLOCK_SECTOR_SIZE / sizeof (block_sector_t))
+
+/* Ways an inode can map its data.  Inodes on disks of format
+   version 0, from before extents, have a format of 0 and so are
+   INODE_INDEXED; inode_create() only makes INODE_EXTENTS ones.
+   See FILESYS_VERSION. */
+enum inode_format
+  {
+    INODE_INDEXED,                      /* One pointer per sector. */
+    INODE_EXTENTS                       /* Runs of sectors. */
+  };
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE=512 bytes long. */
 struct inode_disk
   {
-    block_sector_t direct[123];
-    block_sector_t indirect;
-    block_sector_t doubly_indirect;
+    union
+      {
+        struct                          /* INODE_INDEXED. */
+          {
+            block_sector_t direct[DIRECT_CNT];
+            block_sector_t indirect;
+            block_sector_t doubly_indirect;
+          };
+        struct extent_root extents;     /* INODE_EXTENTS. */
+      };
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
     bool is_dir;                        /* Whether the inode is dir or file. */
+    uint8_t format;                     /* An enum inode_format. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -36,8 +75,8 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode
   {
-    struct lock lock;                   /* Synch for changing inode values (open_cnt, removed) */
-    struct list_elem elem;              /* Element in inode list. */
+    struct rwlock lock;                 /* Shared to use the data, exclusive to change its layout. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
@@ -47,69 +86,492 @@ struct inode
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     bool is_dir;                        /* Whether the inode is dir or file. */
     struct lock dir_lock;               /* Lock for directory */
+
+    struct inode_disk data;             /* Inode content, written through to the cache. */
+
+    struct lock ra_lock;                /* Protects the read-ahead state below. */
+    off_t ra_pos;                       /* Where a sequential read would start. */
+    off_t ra_end;                       /* End of the range already read ahead. */
+    size_t ra_window;                   /* Sectors to read ahead, 0 if not sequential. */
+
+    uint8_t *delayed[DELAY_SECTORS];    /* Data of each delayed sector. */
+    size_t delayed_cnt;                 /* Sectors at the end not yet allocated. */
+
+    uint32_t journal_seq;               /* Transaction that last changed the
+                                           metadata, 0 if none since open. */
   };
 
+/* Returns the number of INODE's sectors that have been given disk
+   sectors.  The rest, at the end of the file, are delayed. */
+static size_t
+mapped_sectors (const struct inode *inode)
+{
+  return bytes_to_sectors (inode->data.length) - inode->delayed_cnt;
+}
+
+/* Returns where the byte at offset POS within INODE is kept, if
+   it lies in a delayed sector, or a null pointer otherwise. */
+static uint8_t *
+delayed_data (const struct inode *inode, off_t pos)
+{
+  size_t mapped = mapped_sectors (inode);
+  size_t idx = pos / BLOCK_SECTOR_SIZE;
+
+  if (pos >= inode->data.length || idx < mapped)
+    return NULL;
+  return inode->delayed[idx - mapped] + pos % BLOCK_SECTOR_SIZE;
+}
+
+/* Frees the buffers of INODE's delayed sectors from the I'th on. */
+static void
+free_delayed (struct inode *inode, size_t i)
+{
+  for (; i < DELAY_SECTORS && inode->delayed[i] != NULL; i++)
+    {
+      free (inode->delayed[i]);
+      inode->delayed[i] = NULL;
+    }
+}
+
+/* Returns the sector stored at index I of the pointer table in
+   sector TABLE, or 0 if TABLE is 0. */
+static block_sector_t
+table_get (block_sector_t table, size_t i)
+{
+  const block_sector_t *ptrs;
+  block_sector_t sector;
+
+  if (table == 0)
+    return 0;
+  ptrs = cache_get (table, CACHE_READ);
+  sector = ptrs[i];
+  cache_put (ptrs, false);
+  return sector;
+}
+
+/* Stores SECTOR at index I of the pointer table in sector
+   *TABLE, first allocating the table, near SECTOR, if *TABLE is
+   0.  Returns false if out of disk space. */
+static bool
+table_set (block_sector_t *table, size_t i, block_sector_t sector)
+{
+  block_sector_t *ptrs;
+
+  if (*table == 0 && allocate_sectors (1, sector, table, true) == 0)
+    return false;
+  ptrs = cache_get (*table, CACHE_WRITE);
+  ptrs[i] = sector;
+  journal_dirty (*table, ptrs);
+  cache_put (ptrs, true);
+  return true;
+}
+
+/* Releases the pointer table in sector TABLE and the sectors it
+   points to, following LEVELS further levels of tables. */
+static void
+table_release (block_sector_t table, int levels)
+{
+  block_sector_t *ptrs;
+  size_t i;
+
+  if (table == 0)
+    return;
+  ptrs = malloc (BLOCK_SECTOR_SIZE);
+  if (ptrs != NULL)
+    {
+      cache_read (table, ptrs);
+      for (i = 0; i < PTRS_PER_SECTOR; i++)
+        if (ptrs[i] == 0)
+          continue;
+        else if (levels > 0)
+          table_release (ptrs[i], levels - 1);
+        else
+          free_map_release (ptrs[i], 1);
+      free (ptrs);
+    }
+  free_map_release (table, 1);
+}
+
+/* Returns the disk sector that holds sector IDX of INODE's data,
+   or 0 if it has none.  If RUN is non-null, stores in it the
+   number of sectors from IDX on known to follow each other on
+   disk, at least 1; only extents tell of more than one. */
+static block_sector_t
+map_lookup (const struct inode *inode, size_t idx, uint32_t *run)
+{
+  const struct inode_disk *disk_inode = &inode->data;
+
+  if (disk_inode->format == INODE_EXTENTS)
+    return extent_lookup (&disk_inode->extents, idx, run);
+
+  if (run != NULL)
+    *run = 1;
+
+  if (idx < DIRECT_CNT)
+    return disk_inode->direct[idx];
+  idx -= DIRECT_CNT;
+  if (idx < PTRS_PER_SECTOR)
+    return table_get (disk_inode->indirect, idx);
+  idx -= PTRS_PER_SECTOR;
+  if (idx < PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+    return table_get (table_get (disk_inode->doubly_indirect,
+                                 idx / PTRS_PER_SECTOR),
+                      idx % PTRS_PER_SECTOR);
+  return 0;
+}
+
+/* Makes SECTOR hold sector IDX of INODE's data, allocating any
+   indirect blocks this needs.  Returns false if out of disk space
+   or IDX is past the largest file an indexed inode can map. */
+static bool
+indexed_set (struct inode *inode, size_t idx, block_sector_t sector)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  block_sector_t middle;
+
+  if (idx < DIRECT_CNT)
+    {
+      disk_inode->direct[idx] = sector;
+      return true;
+    }
+  idx -= DIRECT_CNT;
+  if (idx < PTRS_PER_SECTOR)
+    return table_set (&disk_inode->indirect, idx, sector);
+  idx -= PTRS_PER_SECTOR;
+  if (idx >= PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+    return false;
+  middle = table_get (disk_inode->doubly_indirect, idx / PTRS_PER_SECTOR);
+  if (middle == 0)
+    {
+      if (allocate_sectors (1, sector, &middle, true) == 0)
+        return false;
+      if (!table_set (&disk_inode->doubly_indirect, idx / PTRS_PER_SECTOR,
+                      middle))
+        {
+          free_map_release (middle, 1);
+          return false;
+        }
+    }
+  return table_set (&middle, idx % PTRS_PER_SECTOR, sector);
+}
+
+/* Makes the COUNT contiguous sectors starting at SECTOR hold the
+   sectors of INODE's data starting at IDX, allocating any
+   indirect blocks or extent tree nodes this needs.  Only changes
+   the resident copy of the inode; the caller writes it back.
+   Returns the number of sectors mapped, which is less than COUNT
+   if the disk fills up or the file reaches the largest size its
+   format can map. */
+static size_t
+map_set (struct inode *inode, size_t idx, block_sector_t sector,
+         size_t count)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  size_t i;
+
+  if (disk_inode->format == INODE_EXTENTS)
+    return extent_insert (&disk_inode->extents, idx, sector, count)
+           ? count : 0;
+
+  for (i = 0; i < count; i++)
+    if (!indexed_set (inode, idx + i, sector + i))
+      break;
+  return i;
+}
+
+/* Releases all of INODE's data sectors, and the sectors used to
+   map them. */
+static void
+map_release (struct inode *inode)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  size_t i;
+
+  if (disk_inode->format == INODE_EXTENTS)
+    {
+      extent_release (&disk_inode->extents);
+      return;
+    }
+
+  for (i = 0; i < DIRECT_CNT; i++)
+    if (disk_inode->direct[i] != 0)
+      free_map_release (disk_inode->direct[i], 1);
+  table_release (disk_inode->indirect, 0);
+  table_release (disk_inode->doubly_indirect, 1);
+}
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE, or 0 if that byte lies in a hole, a sector that
+   was never written and reads as zeros.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS, or if that byte's sector is delayed.
+   If RUN is non-null and a sector is returned, stores in it the
+   number of INODE's sectors from POS's on that follow each other
+   on disk, at least 1, as map_lookup() does. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos)
+byte_to_sector (const struct inode *inode, off_t pos, uint32_t *run)
 {
+  size_t idx = pos / BLOCK_SECTOR_SIZE;
+  size_t mapped;
+  block_sector_t sector;
+
   ASSERT (inode != NULL);
-  struct inode_disk* disk_inode = malloc(sizeof(struct inode_disk));;
-  cache_read(inode->sector, disk_inode); 
-  block_sector_t sect;
-  if (pos < disk_inode->length) {
-    size_t sector = pos % 512  == 0 ? bytes_to_sectors(pos) + 1 : bytes_to_sectors(pos);
-    if (sector <= 123) {
-      sect = disk_inode->direct[sector - 1];
-    } else if (sector <= 251) {
-      block_sector_t indirect[128];
-      cache_read(disk_inode->indirect, indirect);
-      sect = indirect[sector - 124];
-    } else {
-      block_sector_t block[128];
-      cache_read(disk_inode->doubly_indirect, block);
-      block_sector_t middle_man = block[DIV_ROUND_UP(sector - 251, 128) - 1];
-      cache_read(middle_man, block);
-      sect = block[((sector - 251 - 1) % 128)];
-    }
-    free(disk_inode);
-    return sect;
-  } else {
-    free(disk_inode);
+  mapped = mapped_sectors (inode);
+  if (pos >= inode->data.length || idx >= mapped)
     return -1;
-  }
+  sector = map_lookup (inode, idx, run);
+  if (run != NULL && *run > mapped - idx)
+    *run = mapped - idx;
+  return sector;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes and the open_cnt of its inodes, so that
+   two threads opening the same inode at once cannot end up with
+   two copies of it. */
+static struct lock open_inodes_lock;
+
+/* Hashes an inode by its sector. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Orders inodes by their sectors. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return hash_entry (a, struct inode, elem)->sector
+         < hash_entry (b, struct inode, elem)->sector;
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("can't create open inode table");
+  lock_init (&open_inodes_lock);
 }
 
-/* Noncontiguous allocation of blocks */
+/* Writes INODE's on-disk inode back as part of the running
+   transaction, and notes that inode_sync() must commit it. */
+static void
+write_inode (struct inode *inode)
+{
+  journal_write (inode->sector, &inode->data);
+  inode->journal_seq = journal_sequence ();
+}
+
+/* Allocates a run of up to SECTORS contiguous sectors, as close
+   after GOAL as possible, and stores the first in *START, zeroing
+   them if ZERO.  Asks for all SECTORS at once and falls back to
+   halving the run until the free map has one that fits.  Returns
+   the number of sectors allocated, 0 if the disk is full. */
 size_t
-allocate_sectors(size_t sectors, block_sector_t* alloced, bool strict)
+allocate_sectors (size_t sectors, block_sector_t goal, block_sector_t *start,
+                  bool zero)
 {
-  size_t i = 0;
   static char zeros[BLOCK_SECTOR_SIZE];
-  while (i < sectors && free_map_allocate(1, alloced + i)) {
-    cache_write(alloced[i], zeros);
-    i += 1;
-  }
-  if (strict && i < sectors) {
-    int j;
-    for (j = i - 1; j >= 0; j--)
-      free_map_release(alloced[j], 1);
-  }
-  return i;
+  size_t i;
+
+  while (sectors > 0 && !free_map_allocate_near (sectors, goal, start))
+    sectors /= 2;
+  if (zero)
+    for (i = 0; i < sectors; i++)
+      cache_write (*start + i, zeros);
+  return sectors;
+}
+
+/* Returns where sector IDX of INODE's data should best go: right
+   after the sector before it, or right after the inode if IDX is
+   the first sector or follows a hole. */
+static block_sector_t
+allocation_goal (const struct inode *inode, size_t idx)
+{
+  block_sector_t prev = idx > 0 ? map_lookup (inode, idx - 1, NULL) : 0;
+
+  return prev != 0 ? prev + 1 : inode->sector + 1;
+}
+
+/* Gives disk sectors to the CNT sectors of INODE's data starting
+   at FIRST, none of which may have one yet.  Allocates them in
+   runs as long as the free map allows, each placed as
+   allocation_goal() suggests.  Does not write to the new
+   sectors.  Returns the number of sectors mapped, which is less
+   than CNT if the disk fills up. */
+static size_t
+allocate_range (struct inode *inode, size_t first, size_t cnt)
+{
+  size_t done = 0;
+
+  while (done < cnt)
+    {
+      block_sector_t start;
+      size_t run, mapped;
+
+      run = allocate_sectors (cnt - done, allocation_goal (inode, first + done),
+                              &start, false);
+      if (run == 0)
+        break;
+      mapped = map_set (inode, first + done, start, run);
+      done += mapped;
+      if (mapped < run)
+        free_map_release (start + mapped, run - mapped);
+      if (mapped == 0)
+        break;
+    }
+  return done;
+}
+
+/* Gives the hole at sector IDX of INODE's data a disk sector,
+   zeroed if ZERO, and writes the inode back.  Returns the new
+   sector, or 0 if the disk is full.  The caller must hold
+   INODE's lock for writing. */
+static block_sector_t
+fill_hole (struct inode *inode, size_t idx, bool zero)
+{
+  block_sector_t sector;
+
+  if (allocate_sectors (1, allocation_goal (inode, idx), &sector, zero) == 0)
+    return 0;
+  if (map_set (inode, idx, sector, 1) == 0)
+    {
+      free_map_release (sector, 1);
+      return 0;
+    }
+  write_inode (inode);
+  return sector;
+}
+
+/* Extends INODE to LENGTH bytes, giving the new sectors disk
+   sectors right away, and writes the inode back.  The caller is
+   about to write the bytes from DATA_START up to LENGTH.  New
+   sectors wholly before DATA_START are left as a hole, and of the
+   rest only those that write does not cover in full are zeroed.
+   If the disk fills up, extends INODE as far as it can.  Returns
+   INODE's new length.  The caller must hold INODE's lock for
+   writing, and INODE must have no delayed sectors. */
+static off_t
+inode_grow (struct inode *inode, off_t length, off_t data_start)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  struct inode_disk *disk_inode = &inode->data;
+  size_t sectors = bytes_to_sectors (disk_inode->length);
+  size_t need = bytes_to_sectors (length);
+  size_t first = data_start / BLOCK_SECTOR_SIZE;
+  size_t got, idx;
+
+  ASSERT (inode->delayed_cnt == 0);
+  if (first < sectors)
+    first = sectors;
+  got = allocate_range (inode, first, need - first);
+  if (got == 0 && first < need)
+    return disk_inode->length;
+  if (got < need - first)
+    length = (off_t) (first + got) * BLOCK_SECTOR_SIZE;
+  for (idx = first; idx < first + got; idx++)
+    {
+      off_t ofs = (off_t) idx * BLOCK_SECTOR_SIZE;
+      if (ofs < data_start || ofs + BLOCK_SECTOR_SIZE > length)
+        cache_write_owned (inode->sector, map_lookup (inode, idx, NULL), zeros,
+                           0, 0, BLOCK_SECTOR_SIZE);
+    }
+  disk_inode->length = length;
+  write_inode (inode);
+  return length;
+}
+
+/* Tries to extend INODE to LENGTH bytes, for a write starting at
+   DATA_START, without giving the new sectors disk sectors yet.
+   They are kept zeroed in memory instead, each in a buffer of its
+   own, against sectors set aside in the free map, until
+   allocate_delayed() allocates them all in one go, so that
+   appends made a little at a time still end up in long runs and
+   are written to disk only once.
+   Returns false if more than DELAY_SECTORS sectors would be
+   delayed, if the write leaves a hole, if memory or disk space
+   is short, or if INODE is a directory, whose blocks are
+   journaled and so need their sectors as soon as written.  The
+   caller must hold INODE's lock for writing. */
+static bool
+inode_delay (struct inode *inode, off_t length, off_t data_start)
+{
+  size_t mapped = mapped_sectors (inode);
+  size_t sectors = bytes_to_sectors (inode->data.length);
+  size_t need = bytes_to_sectors (length);
+  size_t reserve = need - sectors;
+  size_t i;
+
+  if (inode->is_dir)
+    return false;
+  if (need - mapped > DELAY_SECTORS || need == mapped
+      || (size_t) data_start / BLOCK_SECTOR_SIZE > sectors)
+    return false;
+  for (i = sectors - mapped; i < need - mapped; i++)
+    {
+      inode->delayed[i] = calloc (1, BLOCK_SECTOR_SIZE);
+      if (inode->delayed[i] == NULL)
+        {
+          free_delayed (inode, sectors - mapped);
+          return false;
+        }
+    }
+  if (inode->delayed_cnt == 0)
+    reserve += DELAY_SLACK;
+  if (!free_map_reserve (reserve))
+    {
+      free_delayed (inode, sectors - mapped);
+      return false;
+    }
+
+  inode->delayed_cnt = need - mapped;
+  inode->data.length = length;
+  return true;
+}
+
+/* Gives INODE's delayed sectors disk sectors, writes their data
+   to them through the cache, and writes the inode back.  Should
+   the disk fill up despite the sectors set aside, INODE is cut
+   short after the last sector that could be allocated.  The
+   caller must hold INODE's lock for writing. */
+static void
+allocate_delayed (struct inode *inode)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  size_t mapped = mapped_sectors (inode);
+  size_t got, i;
+
+  if (inode->delayed_cnt > 0)
+    {
+      free_map_unreserve (inode->delayed_cnt + DELAY_SLACK);
+      got = allocate_range (inode, mapped, inode->delayed_cnt);
+      for (i = 0; i < got; i++)
+        cache_write_owned (inode->sector, map_lookup (inode, mapped + i, NULL),
+                           inode->delayed[i], 0, 0, BLOCK_SECTOR_SIZE);
+      if (got < inode->delayed_cnt)
+        disk_inode->length = (off_t) (mapped + got) * BLOCK_SECTOR_SIZE;
+      inode->delayed_cnt = 0;
+      write_inode (inode);
+    }
+  free_delayed (inode, 0);
+}
+
+/* Drops INODE's delayed sectors, which are about to be released
+   with the rest of the file anyway. */
+static void
+discard_delayed (struct inode *inode)
+{
+  if (inode->delayed_cnt > 0)
+    free_map_unreserve (inode->delayed_cnt + DELAY_SLACK);
+  inode->data.length = (off_t) mapped_sectors (inode) * BLOCK_SECTOR_SIZE;
+  inode->delayed_cnt = 0;
+  free_delayed (inode, 0);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -123,8 +585,6 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
   
   struct inode_disk *disk_inode = NULL;
   bool success = false;
-  static char zeros[BLOCK_SECTOR_SIZE];
-  cache_write(sector, zeros);
 
   ASSERT (length >= 0);
 
@@ -135,22 +595,16 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      disk_inode->length = 0;
+      /* The data starts out as a single hole, which reads as
+         zeros and takes no sectors until it is written. */
+      disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
       disk_inode->is_dir = is_dir;
-      cache_write(sector, disk_inode);
+      disk_inode->format = INODE_EXTENTS;
+      extent_init (&disk_inode->extents);
+      journal_write (sector, disk_inode);
       free(disk_inode);
-      struct inode* inode = inode_open(sector);
-      char* buffer;
-      buffer = calloc(length, 1);
-      int size = inode_write_at(inode, buffer, length, 0);
-      if (size == length) {
-        success = true;
-      } else {
-        inode_remove(inode);
-      }
-      inode_close(inode);
-      free(buffer);
+      success = true;
     }
   return success;
 }
@@ -161,39 +615,52 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
+  key.sector = sector;
+  lock_acquire (&open_inodes_lock);
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
-        {
-          inode_reopen (inode);
-          return inode;
-        }
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+      return inode;
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  struct inode_disk disk_inode;
-  cache_read (inode->sector, &disk_inode);
-  inode->is_dir = disk_inode.is_dir;
+  inode->ra_pos = 0;
+  inode->ra_end = 0;
+  inode->ra_window = 0;
+  memset (inode->delayed, 0, sizeof inode->delayed);
+  inode->delayed_cnt = 0;
+  inode->journal_seq = 0;
+  cache_read (inode->sector, &inode->data);
+  inode->is_dir = inode->data.is_dir;
   lock_init(&inode->dir_lock);
-  lock_init(&inode->lock);
+  rwlock_init(&inode->lock);
+  lock_init(&inode->ra_lock);
   lock_init(&inode->deny_lock);
   cond_init(&inode->write_allowed);
+
+  /* Only publish the inode once it is fully initialized. */
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -202,7 +669,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -219,56 +690,101 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode)
 {
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
+  /* Just drop the reference if others still have INODE open. */
+  lock_acquire (&open_inodes_lock);
+  if (inode->open_cnt > 1)
+    {
+      inode->open_cnt--;
+      lock_release (&open_inodes_lock);
+      return;
+    }
+  lock_release (&open_inodes_lock);
+
+  /* Give delayed sectors disk sectors and write the inode back
+     while INODE is still in open_inodes, so that an inode_open()
+     meanwhile finds it instead of reading a stale copy from disk.
+     Should INODE be reopened meanwhile, this was merely early. */
+  journal_begin ();
+  rwlock_acquire_write (&inode->lock);
+  if (!inode->removed)
+    allocate_delayed (inode);
+  rwlock_release_write (&inode->lock);
+
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&open_inodes_lock);
+  last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  /* Deallocate blocks if removed.  Its sectors are not handed out
+     again before the running transaction commits, which waits
+     for journal_end(). */
+  if (last && inode->removed)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      discard_delayed (inode);
+      map_release (inode);
+      free_map_release (inode->sector, 1);
+    }
+  journal_end ();
 
-      /* Deallocate blocks if removed. */
-      if (inode->removed)
-        {
-          int block = 0;
-          int total = bytes_to_sectors(inode_length(inode));
-          struct inode_disk disk_inode;
-          cache_read(inode->sector, &disk_inode);
-          while (block < total) {
-            if (block < 123) {
-              free_map_release(disk_inode.direct[block], 1);
-              block += total > 123 ? 123 : total;
-            } else if (block >= 123 && block < 251) {
-              block_sector_t ind[128];
-              cache_read(disk_inode.indirect, ind);
-              int i;
-              for (i = 0; i < (total - 123 < 128 ? total - 123 : 128); i++)
-                free_map_release(ind[i], 1);
-              block += (total - 123 < 128 ? total - 123 : 128);
-              free_map_release(disk_inode.indirect, 1);
-            } else if (block >= 251) {
-              block_sector_t buf_block[128];
-              int mdl_man;
-              for (mdl_man = 0; mdl_man < (DIV_ROUND_UP(total - 251, 128)); mdl_man++) {
-                cache_read(disk_inode.doubly_indirect, buf_block);
-                block_sector_t to_release = buf_block[mdl_man];
-                cache_read(to_release, buf_block);
-                int i;
-                for (i = 0; i < (total - block > 128 ? 128 : total - block); i++)
-                  free_map_release(buf_block[i], 1);
-                block += (total - block > 128 ? 128 : total - block);
-                free_map_release(to_release, 1);
-              }
-              free_map_release(disk_inode.doubly_indirect, 1);
-            }
-          }
-          free_map_release (inode->sector, 1);
-        }
+  if (last)
+    free (inode);
+}
 
-      free (inode);
+/* Gives the delayed sectors of every open inode disk sectors, so
+   that all file data reaches the cache.  The committer calls this
+   before each periodic commit, which bounds how long data can
+   stay delayed. */
+void
+inode_flush_all (void)
+{
+  struct hash_iterator i;
+
+  journal_begin ();
+  lock_acquire (&open_inodes_lock);
+  hash_first (&i, &open_inodes);
+  while (hash_next (&i))
+    {
+      struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
+      if (inode->delayed_cnt == 0)
+        continue;
+      rwlock_acquire_write (&inode->lock);
+      if (!inode->removed)
+        allocate_delayed (inode);
+      rwlock_release_write (&inode->lock);
     }
+  lock_release (&open_inodes_lock);
+  journal_end ();
+}
+
+/* Makes what was written to INODE survive a crash.  Gives its
+   delayed sectors disk sectors and writes back its dirty data,
+   leaving other files' data in the cache.  Only if its inode,
+   block map or, for a directory, entries changed since the last
+   commit does the running transaction have to be committed,
+   which writes back everything else as well. */
+void
+inode_sync (struct inode *inode)
+{
+  uint32_t journal_seq;
+
+  journal_begin ();
+  rwlock_acquire_write (&inode->lock);
+  if (!inode->removed)
+    allocate_delayed (inode);
+  journal_seq = inode->journal_seq;
+  rwlock_release_write (&inode->lock);
+  journal_end ();
+
+  cache_flush_owner (inode->sector);
+  journal_sync (journal_seq);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -280,6 +796,61 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Notes that INODE was just read from byte START up to END and,
+   if that read continued where the previous one stopped, queues
+   the sectors following END for read-ahead.  The window doubles
+   with each sequential read, up to READ_AHEAD_MAX sectors, and
+   collapses as soon as the reader seeks elsewhere.  Only sectors
+   not already requested are queued.  The caller must hold
+   INODE's lock, if only for reading. */
+static void
+update_read_ahead (struct inode *inode, off_t start, off_t end)
+{
+  off_t length, ra_start, ra_stop, pos;
+
+  lock_acquire (&inode->ra_lock);
+  if (start != inode->ra_pos)
+    {
+      inode->ra_window = 0;
+      inode->ra_end = 0;
+    }
+  else if (inode->ra_window == 0)
+    inode->ra_window = READ_AHEAD_MIN;
+  else if (inode->ra_window < READ_AHEAD_MAX)
+    inode->ra_window *= 2;
+  inode->ra_pos = end;
+  if (inode->ra_window == 0)
+    {
+      lock_release (&inode->ra_lock);
+      return;
+    }
+
+  length = inode_length (inode);
+  ra_start = ROUND_UP (end, BLOCK_SECTOR_SIZE);
+  ra_stop = ra_start + (off_t) inode->ra_window * BLOCK_SECTOR_SIZE;
+  if (ra_start < inode->ra_end)
+    ra_start = inode->ra_end;
+  if (ra_stop > length)
+    ra_stop = length;
+
+  pos = ra_start;
+  while (pos < ra_stop)
+    {
+      uint32_t run;
+      block_sector_t sector = byte_to_sector (inode, pos, &run);
+      if (sector == (block_sector_t) -1)
+        break;
+
+      /* Queue the rest of the run without looking up each sector. */
+      for (; run > 0 && pos < ra_stop; run--, pos += BLOCK_SECTOR_SIZE)
+        if (sector != 0)
+          cache_read_ahead (sector++);
+    }
+  if (pos > inode->ra_end)
+    inode->ra_end = pos;
+  lock_release (&inode->ra_lock);
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
@@ -288,26 +859,38 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  lock_acquire(&(inode->lock));
+  rwlock_acquire_read(&inode->lock);
   while (size > 0)
     {
-      /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
-      if (sector_idx == -1)
+      /* Disk sector to read, starting byte offset within sector,
+         and sectors from it on that follow each other on disk.  A
+         hole or a delayed sector is a run of its own. */
+      uint32_t run = 1;
+      block_sector_t sector_idx = byte_to_sector (inode, offset, &run);
+      uint8_t *delayed = delayed_data (inode, offset);
+      if (sector_idx == -1 && delayed == NULL)
         break;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
+      /* Bytes left in inode, bytes left in run, lesser of the two. */
       off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      off_t run_left = (off_t) run * BLOCK_SECTOR_SIZE - sector_ofs;
+      off_t min_left = inode_left < run_left ? inode_left : run_left;
 
-      /* Number of bytes to actually copy out of this sector. */
-      int chunk_size = size < min_left ? size : min_left;
+      /* Number of bytes to actually copy out of these sectors. */
+      off_t chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
 
-      cache_read_many(sector_idx, buffer, bytes_read, sector_ofs, chunk_size);
+      if (delayed != NULL)
+        memcpy (buffer + bytes_read, delayed, chunk_size);
+      else if (sector_idx == 0)
+        memset (buffer + bytes_read, 0, chunk_size);
+      else if (sector_ofs + chunk_size <= BLOCK_SECTOR_SIZE)
+        cache_read_many(sector_idx, buffer, bytes_read, sector_ofs, chunk_size);
+      else
+        cache_read_run (sector_idx, buffer, bytes_read, sector_ofs,
+                        chunk_size);
 
       /* Advance. */
       size -= chunk_size;
@@ -315,113 +898,45 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       bytes_read += chunk_size;
     }
   /*free (bounce);*/
-  lock_release(&(inode->lock)); 
+  if (bytes_read > 0)
+    update_read_ahead (inode, offset - bytes_read, offset);
+  rwlock_release_read(&inode->lock);
 
   return bytes_read;
 }
 
-/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
-   Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
-off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
-                off_t offset)
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   as a single journal operation.  Returns the number of bytes
+   actually written, which is less than SIZE if the disk fills
+   up. */
+static off_t
+write_chunk (struct inode *inode, const uint8_t *buffer, off_t size,
+             off_t offset)
 {
-  const uint8_t *buffer = buffer_;
+  bool metadata = inode->is_dir || inode->sector == FREE_MAP_SECTOR;
   off_t bytes_written = 0;
+  bool exclusive;
 
-  lock_acquire(&inode->deny_lock);
-  if (inode->deny_write_cnt)
-    cond_wait(&inode->write_allowed, &inode->deny_lock);
-  lock_release(&inode->deny_lock);
-
-  lock_acquire(&inode->lock);
-  if (size + offset > inode_length(inode)) {
-    size_t cur_data_sectors = bytes_to_sectors(inode_length(inode));
-    size_t cur_total_sectors = cur_data_sectors <= 123 ? cur_data_sectors : (cur_data_sectors <= 251 ? cur_data_sectors + 1 : cur_data_sectors + 2 + DIV_ROUND_UP(cur_data_sectors - 251, 128));
-    size_t need_data_sectors = bytes_to_sectors(size + offset);
-    size_t need_total_sectors = need_data_sectors <= 123 ? need_data_sectors : (need_data_sectors <= 251 ? need_data_sectors + 1 : need_data_sectors + 2 + DIV_ROUND_UP(need_data_sectors - 251, 128));
-    size_t to_alloc = need_total_sectors - cur_total_sectors;
-    block_sector_t* new_blocks = malloc(to_alloc * sizeof(block_sector_t));
-    size_t num_new_blocks = allocate_sectors(to_alloc, new_blocks, false);
-    
-    struct inode_disk* disk_inode = malloc(sizeof(struct inode_disk));;
-    cache_read(inode->sector, disk_inode);
-    size_t blocks_added = 0;
-    while (blocks_added < num_new_blocks) {
-      if (cur_data_sectors < 123) {
-        memcpy(disk_inode->direct + cur_data_sectors, new_blocks, (num_new_blocks < 123 - cur_data_sectors ? num_new_blocks : 123 - cur_data_sectors) * sizeof(block_sector_t));
-        size_t iter_blocks = (num_new_blocks < 123 - cur_data_sectors ? num_new_blocks : 123 - cur_data_sectors);
-        cur_data_sectors += iter_blocks;
-        blocks_added += iter_blocks;
-      } else if (cur_data_sectors >= 123 && cur_data_sectors < 251) {
-        if (disk_inode->indirect == 0) {
-          if (num_new_blocks - blocks_added > 1) {
-            disk_inode->indirect = new_blocks[blocks_added];
-            blocks_added += 1;
-          } else {
-            free_map_release(new_blocks[blocks_added], 1);
-            blocks_added = num_new_blocks;
-          }
-        } 
-        block_sector_t indirect_block[128];
-        cache_read(disk_inode->indirect, indirect_block);
-        size_t space = 128 - (cur_data_sectors - 123);
-        memcpy(indirect_block + cur_data_sectors - 123, new_blocks + blocks_added, (num_new_blocks - blocks_added < space ? num_new_blocks - blocks_added : space) * sizeof(block_sector_t));
-        cache_write(disk_inode->indirect, indirect_block);
-        cur_data_sectors += (num_new_blocks - blocks_added < space ? num_new_blocks - blocks_added : space);
-        blocks_added += (num_new_blocks - blocks_added < space ? num_new_blocks - blocks_added : space);
-      } else if (cur_data_sectors >= 251) {
-        if (disk_inode->doubly_indirect == 0) {
-          if (num_new_blocks - blocks_added > 1) {
-            disk_inode->doubly_indirect = new_blocks[blocks_added];
-            blocks_added += 1;
-          } else {
-            free_map_release(new_blocks[blocks_added], 1);
-            blocks_added = num_new_blocks;
-            break;
-          }
-        }
-        block_sector_t dbl_ind_block[128];
-        cache_read(disk_inode->doubly_indirect, dbl_ind_block);
-        size_t mdl_man = DIV_ROUND_UP(cur_data_sectors - 251, 128) == 0 ? 0 : ((cur_data_sectors - 251) % 128 == 0 ? DIV_ROUND_UP(cur_data_sectors - 251, 128) : DIV_ROUND_UP(cur_data_sectors - 251, 128) - 1);
-        while (blocks_added < num_new_blocks && mdl_man < 128) {
-          block_sector_t middle_man[128];
-          if (dbl_ind_block[mdl_man] == 0) {
-            if (num_new_blocks - blocks_added > 1) {
-              dbl_ind_block[mdl_man] = new_blocks[blocks_added];
-              blocks_added += 1;
-            } else {
-              blocks_added = num_new_blocks;
-              break;
-            }
-          }
-          if (blocks_added != num_new_blocks) {
-            cache_read(dbl_ind_block[mdl_man], middle_man);
-            memcpy(middle_man + ((cur_data_sectors - 251) % 128) , new_blocks + blocks_added, (128 - ((cur_data_sectors - 251) % 128)) * sizeof(block_sector_t));
-            cache_write(dbl_ind_block[mdl_man], middle_man);
-            size_t iter_blocks = (128 - ((cur_data_sectors - 251) % 128));
-            cur_data_sectors += iter_blocks;
-            blocks_added += iter_blocks;
-            mdl_man += 1;
-          }
-        }
-        cache_write(disk_inode->doubly_indirect, dbl_ind_block);
-      }
-    }
-    disk_inode->length = (cur_data_sectors < need_data_sectors ? cur_data_sectors * BLOCK_SECTOR_SIZE : offset + size);
-    cache_write(inode->sector, disk_inode);
-    free(disk_inode);
-    free(new_blocks);
-    size = cur_data_sectors < need_data_sectors ? inode_length(inode) - offset : size;
+  /* Writers within the file share the lock with readers and each
+     other.  Only a write that extends the file, fills a hole or
+     touches a delayed sector needs the inode to itself. */
+  exclusive = size + offset > inode_length(inode);
+  if (exclusive)
+    rwlock_acquire_write(&inode->lock);
+  else
+    rwlock_acquire_read(&inode->lock);
+  if (size + offset > inode_length(inode)
+      && !inode_delay (inode, size + offset, offset)) {
+    allocate_delayed (inode);
+    off_t length = inode_grow (inode, size + offset, offset);
+    size = length - offset;
   }
-  
+
   while (size > 0)
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx = byte_to_sector (inode, offset, NULL);
+      uint8_t *delayed = delayed_data (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -434,7 +949,34 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      cache_write_many(sector_idx, buffer, bytes_written, sector_ofs, chunk_size);
+      if (!exclusive && (delayed != NULL || sector_idx == 0))
+        {
+          rwlock_release_read(&inode->lock);
+          rwlock_acquire_write(&inode->lock);
+          exclusive = true;
+          continue;
+        }
+
+      /* Writing into a hole gives it a sector. */
+      if (delayed == NULL && sector_idx == 0)
+        {
+          sector_idx = fill_hole (inode, offset / BLOCK_SECTOR_SIZE,
+                                  chunk_size < BLOCK_SECTOR_SIZE);
+          if (sector_idx == 0)
+            break;
+        }
+
+      if (delayed != NULL)
+        memcpy (delayed, buffer + bytes_written, chunk_size);
+      else if (metadata)
+        {
+          journal_write_many (sector_idx, buffer, bytes_written, sector_ofs,
+                              chunk_size);
+          inode->journal_seq = journal_sequence ();
+        }
+      else
+        cache_write_owned (inode->sector, sector_idx, buffer, bytes_written,
+                           sector_ofs, chunk_size);
 
       /* Advance. */
       size -= chunk_size;
@@ -442,7 +984,49 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       bytes_written += chunk_size;
     }
   
-  lock_release(&inode->lock);
+  if (exclusive)
+    rwlock_release_write(&inode->lock);
+  else
+    rwlock_release_read(&inode->lock);
+  return bytes_written;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   Returns the number of bytes actually written, which may be
+   less than SIZE if the disk fills up, or 0 if the file system
+   is read-only.  Directories and the free map are journaled
+   along with the inode; file data is not. */
+off_t
+inode_write_at (struct inode *inode, const void *buffer_, off_t size,
+                off_t offset)
+{
+  const uint8_t *buffer = buffer_;
+  off_t bytes_written = 0;
+
+  if (filesys_read_only ())
+    return 0;
+
+  lock_acquire(&inode->deny_lock);
+  if (inode->deny_write_cnt)
+    cond_wait(&inode->write_allowed, &inode->deny_lock);
+  lock_release(&inode->deny_lock);
+
+  do
+    {
+      off_t chunk = size - bytes_written;
+      off_t written;
+
+      if (chunk > WRITE_CHUNK)
+        chunk = WRITE_CHUNK;
+      journal_begin ();
+      written = write_chunk (inode, buffer + bytes_written, chunk,
+                             offset + bytes_written);
+      journal_end ();
+      bytes_written += written;
+      if (written < chunk)
+        break;
+    }
+  while (bytes_written < size);
   return bytes_written;
 }
 
@@ -476,9 +1060,7 @@ inode_allow_write (struct inode *inode)
 off_t
 inode_length (const struct inode *inode)
 {
-  struct inode_disk disk_inode;
-  cache_read(inode->sector, &disk_inode);
-  return disk_inode.length;
+  return inode->data.length;
 }
 
 bool
@@ -7,7 +7,8 @@
 
 struct bitmap;
 
-size_t allocate_sectors(size_t sectors, block_sector_t* alloced, bool strict);
+size_t allocate_sectors (size_t sectors, block_sector_t goal,
+                         block_sector_t *start, bool zero);
 void inode_init (void);
 bool inode_create (block_sector_t, off_t, bool is_dir);
 struct inode *inode_open (block_sector_t);
@@ -15,6 +16,8 @@ struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+void inode_flush_all (void);
+void inode_sync (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
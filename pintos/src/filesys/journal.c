@@ -0,0 +1,477 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* The journal is a write-ahead log of metadata: inodes, index
+   and extent blocks, directories and the free map.  Operations
+   between journal_begin() and journal_end() join the running
+   transaction, and their metadata sectors are held in the cache,
+   away from the disk, until a commit copies them all to the log.
+   Only then may they reach their own sectors.  After a crash,
+   journal_open() copies the last committed transaction back to
+   where it belongs, so that either all or none of it is seen.
+
+   The log is two areas of the disk used in turn, each a header
+   sector followed by copies of the sectors of one transaction.
+   A commit first writes back everything else that is dirty,
+   which includes the sectors of the transaction before it, and
+   only then writes its own area, so the area being overwritten
+   never holds the only copy of committed metadata. */
+
+/* Identifies a journal header. */
+#define JOURNAL_MAGIC 0x4c4e524a
+
+/* Number of sector copies that one header can describe. */
+#define HEADER_SECTORS ((BLOCK_SECTOR_SIZE - 4 * sizeof (uint32_t)) \
+                        / sizeof (block_sector_t))
+
+/* Most metadata sectors a single operation is expected to change.
+   Operations only join a transaction while it has room for this
+   many more sectors from each of them. */
+#define OP_SECTORS 16
+
+#define COMMIT_INTERVAL (5 * TIMER_FREQ) /* Ticks between commits. */
+#define COMMIT_POLL (TIMER_FREQ / 10)    /* Ticks between checks. */
+
+/* Header of a log area. */
+struct journal_header
+  {
+    uint32_t magic;                     /* JOURNAL_MAGIC. */
+    uint32_t sequence;                  /* Increases with each commit. */
+    uint32_t count;                     /* Number of sector copies. */
+    uint32_t checksum;                  /* Of the header and copies. */
+    block_sector_t sectors[HEADER_SECTORS]; /* Where each copy belongs. */
+  };
+
+static size_t area_sectors;             /* Copies that an area holds. */
+static block_sector_t areas[2];         /* Header sector of each area. */
+static int next_area;                   /* Area the next commit uses. */
+static uint32_t next_sequence;          /* Sequence of the next commit. */
+static struct journal_header header;    /* Header being written or read. */
+
+static block_sector_t *tx;              /* Sectors held by the transaction. */
+static size_t tx_cnt;                   /* Number of sectors in TX. */
+static size_t tx_reserve;               /* Room kept for the free map. */
+static size_t outstanding;              /* Operations in progress. */
+static bool committing;                 /* A commit is waiting or running. */
+static bool active;                     /* Between open and close? */
+static struct lock journal_lock;        /* Protects the above. */
+static struct condition journal_cond;   /* Signaled on state changes. */
+
+static bool committer_exit;             /* Tells the committer to stop. */
+static struct semaphore committer_done; /* Up'd by the committer as it stops. */
+
+static void write_log (void);
+static thread_func committer;
+
+/* Returns the number of copies each log area holds on the file
+   system device, about a 64th of the disk. */
+static size_t
+area_capacity (void)
+{
+  size_t cnt = block_size (fs_device) / 64;
+
+  if (cnt < 2 * OP_SECTORS)
+    cnt = 2 * OP_SECTORS;
+  if (cnt > HEADER_SECTORS)
+    cnt = HEADER_SECTORS;
+  return cnt;
+}
+
+/* Returns the number of sectors the journal takes up, starting at
+   JOURNAL_SECTOR. */
+size_t
+journal_size (void)
+{
+  return 2 * (area_capacity () + 1);
+}
+
+/* Adds SIZE bytes at BUF to SUM, a 32-bit FNV-1a hash. */
+static uint32_t
+checksum (uint32_t sum, const void *buf_, size_t size)
+{
+  const uint8_t *buf = buf_;
+
+  while (size-- > 0)
+    sum = (sum ^ *buf++) * 16777619u;
+  return sum;
+}
+
+/* Returns the checksum of the fields of H that it covers, to be
+   continued over the copies that follow H. */
+static uint32_t
+header_checksum (const struct journal_header *h)
+{
+  uint32_t sum = 2166136261u;
+
+  sum = checksum (sum, &h->sequence, sizeof h->sequence);
+  sum = checksum (sum, &h->count, sizeof h->count);
+  return checksum (sum, h->sectors, h->count * sizeof *h->sectors);
+}
+
+/* Writes an empty transaction to each log area, so that
+   journal_open() finds a valid log on the new file system. */
+void
+journal_create (void)
+{
+  int i;
+
+  area_sectors = area_capacity ();
+  areas[0] = JOURNAL_SECTOR;
+  areas[1] = JOURNAL_SECTOR + 1 + area_sectors;
+  for (i = 0; i < 2; i++)
+    {
+      memset (&header, 0, sizeof header);
+      header.magic = JOURNAL_MAGIC;
+      header.sequence = i;
+      header.checksum = header_checksum (&header);
+      block_write (fs_device, areas[i], &header);
+    }
+}
+
+/* Reads the header of area AREA into HEADER and checks it against
+   the copies, using BUF for them.  Returns true if the area holds
+   a whole committed transaction. */
+static bool
+read_area (int area, void *buf)
+{
+  uint32_t sum;
+  size_t i;
+
+  block_read (fs_device, areas[area], &header);
+  if (header.magic != JOURNAL_MAGIC || header.count > area_sectors)
+    return false;
+  sum = header_checksum (&header);
+  for (i = 0; i < header.count; i++)
+    {
+      block_read (fs_device, areas[area] + 1 + i, buf);
+      sum = checksum (sum, buf, BLOCK_SECTOR_SIZE);
+    }
+  return sum == header.checksum;
+}
+
+/* Opens the journal, first copying the last committed transaction
+   in the log to its sectors, and starts committing periodically.
+   Panics if neither log area holds a valid transaction: then the
+   sectors of the log may belong to files instead, and must not be
+   overwritten. */
+void
+journal_open (void)
+{
+  uint32_t sequence[2];
+  bool valid[2];
+  int newest = -1;
+  void *buf;
+  size_t j;
+  int i;
+
+  area_sectors = area_capacity ();
+  areas[0] = JOURNAL_SECTOR;
+  areas[1] = JOURNAL_SECTOR + 1 + area_sectors;
+  tx = malloc (area_sectors * sizeof *tx);
+  buf = malloc (BLOCK_SECTOR_SIZE);
+  if (tx == NULL || buf == NULL)
+    PANIC ("not enough memory for the journal");
+
+  /* Find the newest whole transaction. */
+  for (i = 0; i < 2; i++)
+    {
+      valid[i] = read_area (i, buf);
+      sequence[i] = header.sequence;
+      if (valid[i] && (newest < 0 || sequence[i] > sequence[newest]))
+        newest = i;
+    }
+  if (newest < 0)
+    PANIC ("no valid journal found; reformat with -f");
+
+  /* Replay it.  Its sectors go through the cache, and are written
+     back before a commit reuses its area. */
+  block_read (fs_device, areas[newest], &header);
+  if (header.count > 0)
+    printf ("Replaying journal: %"PRIu32" sectors.\n", header.count);
+  for (j = 0; j < header.count; j++)
+    {
+      block_read (fs_device, areas[newest] + 1 + j, buf);
+      cache_write (header.sectors[j], buf);
+    }
+  next_area = !newest;
+  next_sequence = header.sequence + 1;
+  free (buf);
+
+  /* Keep room in every transaction for the free map file, which
+     is written as part of each commit. */
+  tx_reserve = DIV_ROUND_UP (block_size (fs_device),
+                             BLOCK_SECTOR_SIZE * 8);
+  tx_cnt = 0;
+  outstanding = 0;
+  committing = false;
+  lock_init (&journal_lock);
+  cond_init (&journal_cond);
+  active = true;
+
+  committer_exit = false;
+  sema_init (&committer_done, 0);
+  thread_create ("committer", PRI_DEFAULT, committer, NULL);
+}
+
+/* Commits what is left and closes the journal.  Metadata written
+   afterward goes straight to the cache. */
+void
+journal_close (void)
+{
+  if (!active)
+    return;
+  committer_exit = true;
+  sema_down (&committer_done);
+  journal_commit ();
+
+  /* Once everything is written back, log an empty transaction, so
+     that the next journal_open() has nothing to replay. */
+  cache_flush ();
+  write_log ();
+  active = false;
+  free (tx);
+}
+
+/* Copies the sectors of the transaction to the next log area,
+   and then writes its header, which commits it. */
+static void
+write_log (void)
+{
+  block_sector_t area = areas[next_area];
+  uint32_t sum;
+  size_t i;
+
+  memset (&header, 0, sizeof header);
+  header.magic = JOURNAL_MAGIC;
+  header.sequence = next_sequence;
+  header.count = tx_cnt;
+  memcpy (header.sectors, tx, tx_cnt * sizeof *tx);
+  sum = header_checksum (&header);
+  for (i = 0; i < tx_cnt; i++)
+    {
+      const void *data = cache_get (tx[i], CACHE_READ);
+      block_write (fs_device, area + 1 + i, data);
+      sum = checksum (sum, data, BLOCK_SECTOR_SIZE);
+      cache_put (data, false);
+    }
+  header.checksum = sum;
+  block_write (fs_device, area, &header);
+
+  next_area = !next_area;
+  next_sequence++;
+}
+
+/* Commits the running transaction.  New operations wait until it
+   is done; those in progress are waited for.  If another thread
+   is already committing, waits for it instead, since its commit
+   includes every operation that has ended.  The caller must hold
+   journal_lock and must not be inside an operation. */
+static void
+commit (void)
+{
+  struct thread *t = thread_current ();
+  size_t i;
+
+  ASSERT (t->journal_depth == 0);
+  if (committing)
+    {
+      while (committing)
+        cond_wait (&journal_cond, &journal_lock);
+      return;
+    }
+  committing = true;
+  while (outstanding > 0)
+    cond_wait (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+
+  /* Bring the free map file up to date as part of the
+     transaction, which also frees the sectors released by it. */
+  t->journal_depth++;
+  free_map_sync ();
+  t->journal_depth--;
+
+  /* Write back file data and everything committed before, so that
+     committed metadata never points to unwritten data and the
+     area about to be overwritten is no longer needed. */
+  cache_flush ();
+
+  if (tx_cnt > 0)
+    {
+      write_log ();
+      for (i = 0; i < tx_cnt; i++)
+        cache_unhold (tx[i]);
+      tx_cnt = 0;
+    }
+
+  lock_acquire (&journal_lock);
+  committing = false;
+  cond_broadcast (&journal_cond, &journal_lock);
+}
+
+/* Commits everything done so far and writes back all file data,
+   so that it survives a crash. */
+void
+journal_commit (void)
+{
+  if (!active)
+    {
+      cache_flush ();
+      return;
+    }
+  lock_acquire (&journal_lock);
+  commit ();
+  lock_release (&journal_lock);
+}
+
+/* Commits the transaction numbered SEQUENCE, as returned by
+   journal_sequence(), unless that is already done.  A SEQUENCE of
+   0 stands for no transaction at all.  Without an open journal,
+   writes back all file data instead. */
+void
+journal_sync (uint32_t sequence)
+{
+  if (!active)
+    {
+      cache_flush ();
+      return;
+    }
+  lock_acquire (&journal_lock);
+  if (sequence >= next_sequence)
+    commit ();
+  lock_release (&journal_lock);
+}
+
+/* Returns the sequence number of the running transaction.  The
+   caller must be inside an operation, which keeps the number from
+   changing. */
+uint32_t
+journal_sequence (void)
+{
+  ASSERT (!active || thread_current ()->journal_depth > 0);
+  return next_sequence;
+}
+
+/* Starts an operation, which changes metadata as part of the
+   running transaction.  Operations may nest; only the outermost
+   counts.  Waits, or commits, while the transaction is too full
+   to be sure of holding the operation.  The caller must not hold
+   any lock a commit might need, such as an inode's. */
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+
+  if (t->journal_depth > 0 || !active)
+    {
+      t->journal_depth++;
+      return;
+    }
+  lock_acquire (&journal_lock);
+  for (;;)
+    {
+      if (committing)
+        cond_wait (&journal_cond, &journal_lock);
+      else if ((tx_cnt > 0 || outstanding > 0)
+               && tx_cnt + (outstanding + 1) * OP_SECTORS + tx_reserve
+                  > area_sectors)
+        commit ();
+      else if (outstanding == 0 && free_map_sync_wanted ())
+        commit ();
+      else
+        break;
+    }
+  outstanding++;
+  t->journal_depth++;
+  lock_release (&journal_lock);
+}
+
+/* Ends an operation started by journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0 || !active)
+    return;
+  lock_acquire (&journal_lock);
+  ASSERT (outstanding > 0);
+  if (--outstanding == 0)
+    cond_broadcast (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Adds SECTOR, pinned with CACHE_WRITE as DATA and about to be put
+   back dirty, to the running transaction.  The caller must be
+   inside an operation.  Should the transaction be full despite
+   journal_begin()'s precautions, the sector is left out of it and
+   written back like file data. */
+void
+journal_dirty (block_sector_t sector, void *data)
+{
+  if (!active)
+    return;
+  ASSERT (thread_current ()->journal_depth > 0);
+  lock_acquire (&journal_lock);
+  if (tx_cnt < area_sectors && cache_hold (data))
+    tx[tx_cnt++] = sector;
+  lock_release (&journal_lock);
+}
+
+/* Writes LENGTH bytes from BUF + BUF_OFS to SECTOR_OFS bytes into
+   metadata SECTOR, as part of the running transaction. */
+void
+journal_write_many (block_sector_t sector, const void *buf, off_t buf_ofs,
+                    off_t sector_ofs, size_t length)
+{
+  uint8_t *data;
+
+  ASSERT (sector_ofs + length <= BLOCK_SECTOR_SIZE);
+  data = cache_get (sector, length == BLOCK_SECTOR_SIZE
+                            ? CACHE_OVERWRITE : CACHE_WRITE);
+  memcpy (data + sector_ofs, (const uint8_t *) buf + buf_ofs, length);
+  journal_dirty (sector, data);
+  cache_put (data, true);
+}
+
+/* Writes BUF to metadata SECTOR, as part of the running
+   transaction. */
+void
+journal_write (block_sector_t sector, const void *buf)
+{
+  journal_write_many (sector, buf, 0, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Commit thread.  Commits every COMMIT_INTERVAL ticks, so that
+   the operations of that span share a single commit.  Delayed
+   file data is given disk sectors first, so that it is not kept
+   in memory, out of reach of the flusher, for longer than that. */
+static void
+committer (void *aux UNUSED)
+{
+  int64_t last_commit = timer_ticks ();
+
+  while (!committer_exit)
+    {
+      timer_sleep (COMMIT_POLL);
+      if (timer_elapsed (last_commit) >= COMMIT_INTERVAL)
+        {
+          inode_flush_all ();
+          journal_commit ();
+          last_commit = timer_ticks ();
+        }
+    }
+  sema_up (&committer_done);
+}
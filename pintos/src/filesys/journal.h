@@ -0,0 +1,28 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/block.h"
+#include "filesys/off_t.h"
+
+/* First sector of the journal, just past the superblock. */
+#define JOURNAL_SECTOR 3
+
+size_t journal_size (void);
+void journal_create (void);
+void journal_open (void);
+void journal_close (void);
+
+void journal_begin (void);
+void journal_end (void);
+void journal_dirty (block_sector_t, void *data);
+void journal_write (block_sector_t, const void *buf);
+void journal_write_many (block_sector_t, const void *buf, off_t buf_ofs,
+                         off_t sector_ofs, size_t length);
+void journal_commit (void);
+void journal_sync (uint32_t sequence);
+uint32_t journal_sequence (void);
+
+#endif /* filesys/journal.h */
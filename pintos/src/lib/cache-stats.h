@@ -0,0 +1,19 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+/* Buffer cache counters, as reported by the cachestat system
+   call.  Shared between the kernel and user programs. */
+struct cache_stats
+  {
+    unsigned long long hits;            /* Accesses that found the sector cached. */
+    unsigned long long misses;          /* Accesses that had to map the sector. */
+    unsigned long long evictions;       /* Entries taken over from another sector. */
+    unsigned long long write_backs;     /* Dirty entries written to disk. */
+    unsigned long long flushes;         /* Passes writing back every dirty entry. */
+    unsigned long long read_aheads;     /* Sectors loaded by read-ahead. */
+    unsigned long long read_ahead_hits; /* Read-ahead sectors later accessed. */
+    unsigned long long lock_waits;      /* Times a thread waited for a lock. */
+    unsigned long long lock_wait_ticks; /* Timer ticks spent waiting for locks. */
+  };
+
+#endif /* lib/cache-stats.h */
@@ -188,3 +188,21 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+void
+cachestat (struct cache_stats *stats, bool reset)
+{
+  syscall2 (SYS_CACHESTAT, stats, (int) reset);
+}
+
+void
+fsync (int fd)
+{
+  syscall1 (SYS_FSYNC, fd);
+}
+
+void
+sync (void)
+{
+  syscall0 (SYS_SYNC);
+}
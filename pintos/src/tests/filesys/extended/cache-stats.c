@@ -0,0 +1,42 @@
+/* Writes a file, closes and reopens it so that its data has been
+   given disk sectors and so passes through the buffer cache, then
+   reads it back and checks that the cache reports hits for it,
+   and that resetting the counters clears them. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[4096];
+
+void
+test_main (void)
+{
+  const char *file_name = "cached";
+  struct cache_stats stats;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  CHECK ((fd = open (file_name)) > 1, "reopen \"%s\"", file_name);
+
+  msg ("reset cache statistics");
+  cachestat (NULL, true);
+  CHECK (read (fd, buf, sizeof buf) == sizeof buf, "read \"%s\"", file_name);
+  cachestat (&stats, true);
+  if (stats.hits == 0)
+    fail ("no cache hits reading back \"%s\"", file_name);
+  msg ("cache hits reported");
+
+  cachestat (&stats, false);
+  if (stats.hits != 0 || stats.misses != 0)
+    fail ("counters not reset: %llu hits, %llu misses",
+          stats.hits, stats.misses);
+  msg ("cache statistics reset");
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
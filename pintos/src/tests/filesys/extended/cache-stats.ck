@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-stats) begin
+(cache-stats) create "cached"
+(cache-stats) open "cached"
+(cache-stats) write "cached"
+(cache-stats) close "cached"
+(cache-stats) reopen "cached"
+(cache-stats) reset cache statistics
+(cache-stats) read "cached"
+(cache-stats) cache hits reported
+(cache-stats) cache statistics reset
+(cache-stats) close "cached"
+(cache-stats) end
+EOF
+pass;
@@ -0,0 +1,72 @@
+/* Writes two files and syncs them, then overwrites both in place
+   and checks that fsync on one of them writes back its sectors
+   and not the other's, which a later fsync on the other one
+   writes back.  The flusher and the committer may write back
+   either file at any time, so the overwrites and fsyncs are
+   repeated until no flush pass ran while they were measured. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define TRIES 10
+
+static char buf[1024];
+
+/* Overwrites the file open as FD with BUF filled with C. */
+static void
+overwrite (int fd, char c)
+{
+  memset (buf, c, sizeof buf);
+  seek (fd, 0);
+  if (write (fd, buf, sizeof buf) != sizeof buf)
+    fail ("overwrite \"%c\" failed", c);
+}
+
+void
+test_main (void)
+{
+  struct cache_stats after_a, after_b;
+  size_t sectors = sizeof buf / 512;
+  int fd_a, fd_b, try;
+
+  CHECK (create ("a", 0), "create \"a\"");
+  CHECK (create ("b", 0), "create \"b\"");
+  CHECK ((fd_a = open ("a")) > 1, "open \"a\"");
+  CHECK ((fd_b = open ("b")) > 1, "open \"b\"");
+  CHECK (write (fd_a, buf, sizeof buf) == sizeof buf, "write \"a\"");
+  CHECK (write (fd_b, buf, sizeof buf) == sizeof buf, "write \"b\"");
+  msg ("sync");
+  sync ();
+
+  msg ("overwrite \"a\" and \"b\", then fsync \"a\" and \"b\"");
+  for (try = 0; ; try++)
+    {
+      if (try == TRIES)
+        fail ("a flush pass ran during each of %d tries", TRIES);
+      overwrite (fd_a, 'a');
+      overwrite (fd_b, 'b');
+      cachestat (NULL, true);
+      fsync (fd_a);
+      cachestat (&after_a, false);
+      fsync (fd_b);
+      cachestat (&after_b, false);
+      if (after_b.flushes == 0)
+        break;
+    }
+
+  if (after_a.write_backs != sectors)
+    fail ("fsync \"a\" wrote back %llu sectors, expected %zu",
+          after_a.write_backs, sectors);
+  msg ("fsync \"a\" wrote back only \"a\"");
+  if (after_b.write_backs - after_a.write_backs != sectors)
+    fail ("fsync \"b\" wrote back %llu sectors, expected %zu",
+          after_b.write_backs - after_a.write_backs, sectors);
+  msg ("fsync \"b\" wrote back \"b\"");
+
+  msg ("close \"a\"");
+  close (fd_a);
+  msg ("close \"b\"");
+  close (fd_b);
+}
@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fsync) begin
+(fsync) create "a"
+(fsync) create "b"
+(fsync) open "a"
+(fsync) open "b"
+(fsync) write "a"
+(fsync) write "b"
+(fsync) sync
+(fsync) overwrite "a" and "b", then fsync "a" and "b"
+(fsync) fsync "a" wrote back only "a"
+(fsync) fsync "b" wrote back "b"
+(fsync) close "a"
+(fsync) close "b"
+(fsync) end
+EOF
+pass;
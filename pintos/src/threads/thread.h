@@ -112,6 +112,7 @@ struct thread
 #endif
     
     struct dir *cwd;     /* Current working directory */
+    int journal_depth;   /* Nesting of journal operations */
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
   };
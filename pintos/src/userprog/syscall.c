@@ -11,6 +11,7 @@
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 #include "threads/malloc.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
@@ -427,6 +428,51 @@ syscall_handler (struct intr_frame *f UNUSED)
       }
       f->eax = inode_get_inumber(inum_inode);
       break;
+    case SYS_CACHESTAT:
+      check_valid_ptr ((uint8_t*) args, 12, f);
+      /* Snapshot the counters before resetting them, so a
+         benchmark can read and restart them in one call */
+      struct cache_stats *user_stats = (struct cache_stats *) args[1];
+      if (user_stats != NULL)
+        {
+          struct cache_stats stats;
+          check_valid_ptr ((uint8_t*) user_stats, sizeof stats, f);
+          cache_get_stats (&stats);
+          memcpy (user_stats, &stats, sizeof stats);
+        }
+      if (args[2])
+        cache_reset_stats ();
+      break;
+    case SYS_FSYNC:
+      check_valid_ptr ((uint8_t*) args, 8, f);
+      fd = (int) args[1];
+      struct list_elem *fsync_e;
+      struct fs_bundle * fsync_fb = NULL;
+      for (fsync_e = list_begin (&thread_current ()->files); fsync_e != list_end (&thread_current ()->files);
+           fsync_e = list_next (fsync_e))
+        {
+          fsync_fb = list_entry (fsync_e, struct fs_bundle, fs_elem);
+          if (fsync_fb->fd == fd)
+            {
+              break;
+            }
+        }
+      if (fsync_e == list_end (&thread_current ()->files))
+        {
+          syscall_exit(-1, f);
+        }
+      /* Only this file's dirty sectors are written, unless its
+         metadata changed and the journal must commit */
+      if (fsync_fb->is_dir){
+        inode_sync(dir_get_inode(fsync_fb->dir));
+      } else{
+        inode_sync(file_get_inode(fsync_fb->file));
+      }
+      break;
+    case SYS_SYNC:
+      check_valid_ptr ((uint8_t*) args, 4, f);
+      filesys_sync ();
+      break;
   }
 }
     